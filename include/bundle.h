@@ -0,0 +1,53 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <stdint.h>
+
+#include "cache.h"
+
+// = Wallpaper bundle =
+// A .vpk file holds a shader together with loops pre-rendered from it, so a machine that only
+// plays wallpapers never compiles or renders anything. It is laid out to be mapped as a whole:
+// a header, an index of tracks and the shader sources, then one page aligned track per baked
+// resolution, each a complete cache in the cache file format.
+struct bundle;
+
+struct bundle_info
+{
+    const char *source;   // Shader as it was written
+    const char *shader;   // Source that gets compiled, converted from shadertoy if it was one
+    uint64_t shader_hash; // cache_hash of shader, part of every track's key
+    int fps;
+    int cache_seconds;
+    int track_count;
+};
+
+// One baked loop for bundle_write
+struct bundle_track
+{
+    const struct cache_key *key;
+    const struct cache_format *format;
+    const struct cached_frame *frames;
+    int frame_count;
+};
+
+// Writes a bundle to path, replacing any previous file atomically
+int bundle_write(const char *path, const char *source, const char *shader, int fps, int cache_seconds,
+                 const struct bundle_track *tracks, int track_count);
+
+// Maps a bundle, returns NULL if path isn't one
+struct bundle *bundle_open(const char *path);
+
+const struct bundle_info *bundle_get_info(const struct bundle *bundle);
+
+// The track baked at w x h, else the biggest one for the GPU to scale. -1 if the bundle has none
+int bundle_find_track(const struct bundle *bundle, int w, int h);
+
+// Points frames[] into the mapped track like cache_file_load, *key gets the key it was baked with
+int bundle_load_track(const struct bundle *bundle, int track, struct cached_frame *frames, int max_frames, int *frame_count,
+                      struct cache_key *key, struct cache_format *format);
+
+// Unmaps the bundle, frames pointing into it become invalid
+void bundle_close(struct bundle *bundle);
+
+#endif
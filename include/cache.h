@@ -0,0 +1,186 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct frame_codec_ops;
+
+// One encoded frame, as produced by the cache codec (wrapped as a delta frame in delta mode)
+struct cached_frame
+{
+    unsigned char *data;
+    size_t size;
+    int source; // Frame that owns data, an earlier one if this frame is a duplicate of it
+};
+
+// = Frame arena =
+// Encoded frames are appended into a few large anonymous mappings instead of getting a heap block
+// each, so a long cache doesn't scatter thousands of allocations over the heap. Memory is only
+// given back all at once by frame_arena_destroy.
+struct frame_arena;
+
+// huge_pages asks the kernel to back the arena with transparent huge pages
+struct frame_arena *frame_arena_create(int huge_pages);
+
+// Thread-safe, returns NULL if no more memory could be mapped
+void *frame_arena_alloc(struct frame_arena *arena, size_t size);
+
+void frame_arena_destroy(struct frame_arena *arena);
+
+// = Encoder pool =
+// Frames read back from the GPU are queued here and compressed on worker threads.
+// The pool owns a fixed number of RGBA buffers, so memory stays capped no matter how
+// far the render thread gets ahead of the encoders. Frames land in frames[] out of order.
+struct encode_pool;
+
+// workers <= 0 picks one worker per online cpu (minus the render thread).
+// With delta set every frame is stored as a delta frame, see delta_encode. Encoded frames are
+// copied into arena
+struct encode_pool *encode_pool_create(int workers, int w, int h, const struct frame_codec_ops *codec, int quality, int delta,
+                                       struct frame_arena *arena, struct cached_frame *frames);
+
+// Blocks until an RGBA buffer is free to be filled by glReadPixels
+unsigned char *encode_pool_acquire(struct encode_pool *pool);
+
+// Queues a filled buffer (returned by encode_pool_acquire) to be encoded into frames[frame_index].
+// In delta mode, tile_count >= 0 stores only the listed tiles and tile_count < 0 a keyframe
+void encode_pool_submit(struct encode_pool *pool, unsigned char *rgba, int frame_index, const uint32_t *tiles, int tile_count);
+
+// Gives a buffer from encode_pool_acquire back without encoding it
+void encode_pool_discard(struct encode_pool *pool, unsigned char *rgba);
+
+// Waits for all queued frames, returns 0 on success or -1 if any frame failed to encode
+int encode_pool_finish(struct encode_pool *pool);
+
+// Stops the workers, prints the codec stats and frees the buffers, frames already encoded are left in place
+void encode_pool_destroy(struct encode_pool *pool);
+
+// = Decode ring =
+// A background thread decodes the frames that follow the one on screen into a fixed ring
+// of reusable frame buffers, so playback only has to upload and draw.
+struct decode_ring;
+
+// What the decoder produces for playback
+enum frame_format
+{
+    FRAME_RGBA,   // w * h * 4 bytes
+    FRAME_YUV420, // Y/Cb/Cr planes as described by jpeg_yuv_layout
+};
+
+// depth is how many frames the decoder may run ahead of playback, FRAME_YUV420 needs a codec with decode_yuv.
+// threads > 1 decodes each frame on that many threads if the codec supports it, <= 0 picks one per online cpu
+struct decode_ring *decode_ring_create(int depth, int w, int h, const struct frame_codec_ops *codec, int delta, enum frame_format format,
+                                       int threads, const struct cached_frame *frames, int frame_count);
+
+// Same as decode_ring_create for whole RGBA frames, but frames are decoded straight into the caller's
+// buffers (depth of them, w * h * 4 bytes each), slot i always using buffers[i]. They must outlive the ring
+struct decode_ring *decode_ring_create_into(int depth, int w, int h, const struct frame_codec_ops *codec, int threads,
+                                            unsigned char *const *buffers, const struct cached_frame *frames, int frame_count);
+
+struct decoded_frame
+{
+    int frame_idx;
+    unsigned char *pixels; // NULL if the frame failed to decode
+    int tile_count;        // -1 for a whole frame, else pixels is a strip of tile_count delta tiles
+    const uint32_t *tiles; // Which tiles the strip holds
+    int scale;             // Whole frames are decoded at 1/scale of the frame size, see decode_ring_set_low_power
+};
+
+// Blocks until the next frame in loop order is decoded,
+// the slot must be given back with decode_ring_release once uploaded.
+// Several frames may be taken before releasing any, they come from consecutive slots
+const struct decoded_frame *decode_ring_next(struct decode_ring *ring);
+
+// Hands the oldest slot returned by decode_ring_next back to the decoder once it has been uploaded
+void decode_ring_release(struct decode_ring *ring);
+
+// Playback that fell behind wants frame_idx next: the decoder jumps there once done with the frame it
+// is on, unless frame_idx is already decoded. Frames already in the ring are still handed out, and
+// delta rings ignore it since every frame builds on the one before
+void decode_ring_seek(struct decode_ring *ring, int frame_idx);
+
+// Low power playback: while decoding a frame takes longer than frame_time, the decoder halves the
+// resolution it decodes at (down to 1/8) and leaves upscaling to the GPU. It goes back up once the
+// larger size would fit again. Returns -1 if the ring can't decode its frames scaled
+int decode_ring_set_low_power(struct decode_ring *ring, double frame_time);
+
+void decode_ring_destroy(struct decode_ring *ring);
+
+// = Cache file =
+// Finished caches are saved under $XDG_CACHE_HOME/vecpaper and memory mapped on the next run
+// with the same key, so an unchanged wallpaper starts playing without rendering anything.
+struct cache_key
+{
+    uint64_t shader_hash; // Hash of the final shader source as it is compiled
+    int width, height;
+    int fps;
+    int cache_seconds;
+    uint32_t codec; // frame_codec_ops id
+    int quality;
+    int delta;      // Frames stored as tile deltas
+    int mem_budget; // MiB, 0 for no budget
+};
+
+// How the frames were actually encoded, a memory budget can lower both from what the key asks for
+struct cache_format
+{
+    int width, height;
+    int quality;
+};
+
+struct cache_file;
+
+#define CACHE_HASH_INIT 0xcbf29ce484222325ULL
+
+// 64-bit FNV-1a, pass CACHE_HASH_INIT to start a new hash
+uint64_t cache_hash(uint64_t hash, const void *data, size_t len);
+
+// Much faster 64-bit hash for whole frames, identical frames hash the same. Not cryptographic: different
+// frames collide with a chance of about n^2 / 2^65 over n frames, as long as nobody crafts them to
+uint64_t frame_hash(const void *data, size_t len);
+
+// Writes the path of the cache file for key into out, creating the cache directory if needed
+int cache_file_path(const struct cache_key *key, char *out, size_t out_size);
+
+// Maps the cache file and points frames[] into it, returns NULL if there is no usable file.
+// The loop may be shorter than max_frames if its period was detected, *frame_count gets its length
+struct cache_file *cache_file_load(const char *path, const struct cache_key *key, struct cached_frame *frames, int max_frames,
+                                   int *frame_count, struct cache_format *format);
+
+// Writes frames[] to path, replacing any previous file atomically. Duplicates share their source's data
+int cache_file_save(const char *path, const struct cache_key *key, const struct cache_format *format,
+                    const struct cached_frame *frames, int frame_count);
+
+// Unmaps a loaded cache file, frames pointing into it become invalid
+void cache_file_unmap(struct cache_file *file);
+
+// Writes frames[] in the cache file format at the current position of f, offsets in it are relative to
+// where it starts so it can be embedded in another file. *size gets the number of bytes written
+int cache_write(FILE *f, const struct cache_key *key, const struct cache_format *format, const struct cached_frame *frames,
+                int frame_count, uint64_t *size);
+
+// Checks a cache in the file format that is already in memory against key and points frames[] into it
+// like cache_file_load, name is only for messages. Returns -1 if it doesn't match
+int cache_parse(const void *data, size_t size, const char *name, const struct cache_key *key, struct cached_frame *frames, int max_frames,
+                int *frame_count, struct cache_format *format);
+
+// = Shared cache =
+// One instance runs per monitor, so with several identical monitors the first instance to hold a
+// finished cache copies it into a sealed memfd and hands that out over a Unix socket in
+// $XDG_RUNTIME_DIR. Instances with the same key map it instead of keeping a copy of their own.
+struct cache_share;
+
+// Starts sharing frames[] and points them into the shared memory, which stays valid until cache_share_destroy.
+// Returns NULL, leaving frames[] alone, if another instance already shares this key or sharing failed
+struct cache_share *cache_share_publish(const struct cache_key *key, const struct cache_format *format, struct cached_frame *frames,
+                                        int frame_count);
+
+void cache_share_destroy(struct cache_share *share);
+
+// Maps the cache shared by another instance like cache_file_load, returns NULL if nobody shares this key
+struct cache_file *cache_share_fetch(const struct cache_key *key, struct cached_frame *frames, int max_frames, int *frame_count,
+                                     struct cache_format *format);
+
+#endif
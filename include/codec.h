@@ -0,0 +1,158 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// = Frame codecs =
+// Each cache codec is a table of functions over its own per-thread state. Encoders take RGBA
+// frames and return the result in a buffer owned by the state, valid until the next encode on
+// the same state. Decoders write into a caller supplied w * h * 4 RGBA buffer.
+struct frame_codec_ops
+{
+    uint32_t id;      // Stored in cache files, never reuse one
+    const char *name; // As given to --cache-codec
+    int lossy;        // Decoded frames can differ from the encoded ones
+    int has_quality;  // Whether --cache-quality applies
+
+    // Compressed GL texture format encoded frames can be uploaded as without decoding, 0 if there is none
+    uint32_t gl_format;
+
+    void *(*create)(void);
+    void (*destroy)(void *state);
+    const unsigned char *(*encode)(void *state, const unsigned char *rgba, int w, int h, int quality, size_t *out_size);
+    int (*decode)(void *state, const unsigned char *data, size_t size, int w, int h, unsigned char *rgba);
+
+    // Optional, decodes straight to planes as described by jpeg_yuv_layout
+    int (*decode_yuv)(void *state, const unsigned char *data, size_t size, int w, int h, unsigned char *planes);
+
+    // Optional, decodes to RGBA at 1/scale of w x h (see frame_scaled_size) for scale 2, 4 or 8
+    int (*decode_scaled)(void *state, const unsigned char *data, size_t size, int w, int h, int scale, unsigned char *rgba);
+
+    // Optional, spreads each decode over this many threads owned by the state, the calling one included
+    int (*set_threads)(void *state, int threads);
+};
+
+extern const struct frame_codec_ops jpeg_frame_codec;
+extern const struct frame_codec_ops qoi_frame_codec;
+extern const struct frame_codec_ops raw_frame_codec;
+extern const struct frame_codec_ops etc2_frame_codec;
+
+// Returns NULL if there is no codec with that name
+const struct frame_codec_ops *frame_codec_find(const char *name);
+
+// Returns NULL if there is no codec with that id
+const struct frame_codec_ops *frame_codec_find_id(uint32_t id);
+
+// Walks the registered codecs, returns NULL past the last one
+const struct frame_codec_ops *frame_codec_at(size_t index);
+
+struct codec_stats
+{
+    uint64_t frames_encoded, frames_decoded;
+    uint64_t raw_bytes;     // RGBA bytes that went into the encoder
+    uint64_t encoded_bytes; // Bytes that came out of it
+    double encode_seconds, decode_seconds;
+};
+
+// A codec state plus the stats of everything it encoded and decoded
+struct frame_codec;
+
+struct frame_codec *frame_codec_create(const struct frame_codec_ops *ops);
+void frame_codec_destroy(struct frame_codec *codec);
+
+const unsigned char *frame_codec_encode(struct frame_codec *codec, const unsigned char *rgba, int w, int h, int quality, size_t *out_size);
+int frame_codec_decode(struct frame_codec *codec, const unsigned char *data, size_t size, int w, int h, unsigned char *rgba);
+
+// Returns -1 if the codec can't decode to YUV planes
+int frame_codec_decode_yuv(struct frame_codec *codec, const unsigned char *data, size_t size, int w, int h, unsigned char *planes);
+
+// Returns -1 if the codec can't decode a frame on more than one thread
+int frame_codec_set_threads(struct frame_codec *codec, int threads);
+
+// Returns -1 if the codec can't decode at a reduced scale
+int frame_codec_decode_scaled(struct frame_codec *codec, const unsigned char *data, size_t size, int w, int h, int scale, unsigned char *rgba);
+
+// Width or height of a frame decoded at 1/scale, rounded up
+int frame_scaled_size(int size, int scale);
+
+const struct codec_stats *frame_codec_stats(const struct frame_codec *codec);
+void codec_stats_add(struct codec_stats *total, const struct codec_stats *stats);
+void codec_stats_print(const struct frame_codec_ops *ops, const struct codec_stats *stats);
+
+// Mean SSIM of the luma of two RGBA frames over 8x8 blocks, 1.0 for identical frames
+double frame_ssim(const unsigned char *a, const unsigned char *b, int w, int h);
+
+// = JPEG =
+// Long-lived libjpeg-turbo state, one per thread. Frames go straight from/to RGBA through the
+// extended colorspaces, and every buffer is reused between frames so nothing is allocated per frame
+struct jpeg_codec;
+
+struct jpeg_codec *jpeg_codec_create(void);
+void jpeg_codec_destroy(struct jpeg_codec *codec);
+
+// Compress RGBA into JPEG. The result lives in the codec's scratch buffer and stays valid
+// until the next encode on the same codec, returns NULL on failure
+const unsigned char *jpeg_codec_encode(struct jpeg_codec *codec, const unsigned char *rgba, int w, int h, int quality, size_t *out_size);
+
+// Decompress JPEG into a caller supplied w * h * 4 RGBA buffer, returns 0 on success
+int jpeg_codec_decode(struct jpeg_codec *codec, const unsigned char *jpeg_data, size_t jpeg_size, int w, int h, unsigned char *rgba);
+
+// Same at 1/scale of the size in each direction (1, 2, 4 or 8). The scaling happens inside the
+// inverse DCT, so a smaller output is also that much cheaper to decode
+int jpeg_codec_decode_scaled(struct jpeg_codec *codec, const unsigned char *jpeg_data, size_t jpeg_size, int w, int h, int scale,
+                             unsigned char *rgba);
+
+// Decodes every frame that carries a restart index (all frames this codec encodes do) as horizontal
+// slices on this many threads, the calling one included. 1 goes back to decoding on the calling thread
+int jpeg_codec_set_threads(struct jpeg_codec *codec, int threads);
+
+// Planar YUV 4:2:0 as libjpeg stores it, Y then Cb then Cr in one buffer. Planes are padded to
+// whole 16x16 MCUs, the visible w x h area starts at the top-left corner of each plane
+struct yuv_layout
+{
+    int y_stride, y_rows;
+    int c_stride, c_rows;
+    size_t y_size, c_size;
+    size_t total_size;
+};
+
+void jpeg_yuv_layout(int w, int h, struct yuv_layout *layout);
+
+// Decompress a 4:2:0 JPEG straight to its Y/Cb/Cr planes, skipping color conversion and
+// chroma upsampling. planes must hold jpeg_yuv_layout(w, h).total_size bytes, returns 0 on success
+int jpeg_codec_decode_yuv(struct jpeg_codec *codec, const unsigned char *jpeg_data, size_t jpeg_size, int w, int h, unsigned char *planes);
+
+// = Delta frames =
+// A delta frame stores only the tiles that changed since the previous frame, packed top to bottom
+// into one strip DELTA_TILE_SIZE pixels wide and encoded with the cache codec. Tiles are numbered
+// row by row over the frame, edge tiles are padded to full size by repeating their last column/row.
+// Frame layout: "VPD1", uint32 tile count or DELTA_KEYFRAME, uint32 tile indices, encoded strip
+// or whole frame (omitted if no tiles changed)
+#define DELTA_TILE_SIZE 64
+#define DELTA_TILE_BYTES (DELTA_TILE_SIZE * DELTA_TILE_SIZE * 4)
+#define DELTA_KEYFRAME 0xFFFFFFFFu
+
+// JPEG can't be taller than 65500 pixels, frames changing more tiles than this become keyframes
+#define DELTA_MAX_TILES (65500 / DELTA_TILE_SIZE)
+
+int delta_tiles_x(int w);
+int delta_tile_count(int w, int h);
+
+// Size of a buffer that can hold a whole RGBA frame or the decoded strip of any delta frame
+size_t delta_frame_capacity(int w, int h);
+
+// Compares two RGBA frames and writes the indices of changed tiles into tiles, returns how many
+int delta_find_dirty_tiles(const unsigned char *prev, const unsigned char *cur, int w, int h, uint32_t *tiles);
+
+// Encodes the listed tiles of rgba as a delta frame, or the whole frame as a keyframe if
+// tile_count < 0. Same buffer rules as frame_codec_encode
+const unsigned char *delta_encode(struct frame_codec *codec, const unsigned char *rgba, int w, int h, int quality,
+                                  const uint32_t *tiles, int tile_count, size_t *out_size);
+
+// Keyframes fill out with the whole frame and set *tile_count to -1,
+// delta frames fill out with the tile strip and tiles with their indices
+int delta_decode(struct frame_codec *codec, const unsigned char *data, size_t size, int w, int h,
+                 unsigned char *out, uint32_t *tiles, int *tile_count);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef DMABUF_H
+#define DMABUF_H
+
+#include <stddef.h>
+
+// = DMA-BUF frames =
+// Frame buffers in memfd memory that is also exported as a dma-buf through /dev/udmabuf, so the
+// GPU can sample a frame right where the decoder wrote it (see EGL_EXT_image_dma_buf_import).
+struct dma_frame
+{
+    int fd;              // dma-buf of this frame
+    unsigned char *data; // w * h * 4 bytes, rows w * 4 bytes apart
+};
+
+struct dma_frames
+{
+    int count;
+    int w, h;
+    size_t size; // Of the whole mapping
+    void *map;
+    struct dma_frame frames[];
+};
+
+// Returns NULL if udmabuf isn't available or the buffers couldn't be created
+struct dma_frames *dma_frames_create(int w, int h, int count);
+
+void dma_frames_destroy(struct dma_frames *frames);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdint.h>
+
+struct wl_display;
+struct wl_event_queue;
+
+// = Event loop =
+// Everything playback waits on goes through one epoll set: the Wayland socket, a timerfd for the next
+// frame deadline, signals through a signalfd and any other fd added to it. A dispatch sleeps until one
+// of them is ready, so nothing runs while there is nothing to do.
+struct event_loop;
+
+// Called with the epoll events the fd is ready for, returning -1 stops the loop
+typedef int (*event_loop_fn)(void *data, uint32_t events);
+
+// display may be NULL for a loop without Wayland. The loop dispatches queue, or the default queue if
+// NULL. Loops on different threads may share the display as long as each has a queue of its own
+struct event_loop *event_loop_create(struct wl_display *display, struct wl_event_queue *queue);
+
+void event_loop_destroy(struct event_loop *loop);
+
+// Calls fn whenever fd is ready for any of events (EPOLLIN, EPOLLOUT...), the fd stays owned by the caller
+int event_loop_add_fd(struct event_loop *loop, int fd, uint32_t events, event_loop_fn fn, void *data);
+
+// Safe to call from a callback, no more calls for fd are made after it returns
+void event_loop_remove_fd(struct event_loop *loop, int fd);
+
+// Blocks signo in the calling thread and delivers it through a signalfd instead. Threads inherit the
+// mask, so this has to come before any thread is started or they may still take the signal
+int event_loop_add_signal(struct event_loop *loop, int signo, event_loop_fn fn, void *data);
+
+// Arms the timer for an absolute CLOCK_MONOTONIC time in ns, replacing the previous deadline. It only
+// wakes event_loop_dispatch up, callers check the time themselves
+void event_loop_set_deadline(struct event_loop *loop, int64_t deadline);
+
+// Waits up to timeout_ms (-1 forever, 0 to only poll) for any source, reads the Wayland events,
+// dispatches the ones on the loop's queue and calls the callbacks of the ready fds. Returns -1 once
+// the loop was stopped or the compositor is gone, and from then on without waiting
+int event_loop_dispatch(struct event_loop *loop, int timeout_ms);
+
+#endif
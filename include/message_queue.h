@@ -0,0 +1,33 @@
+#ifndef MESSAGE_QUEUE_H
+#define MESSAGE_QUEUE_H
+
+#include <stdint.h>
+
+// = Message queue =
+// Fixed size single producer, single consumer ring for passing small messages between two threads
+// without a lock. An eventfd counts the queued messages, so the consumer can sleep on it in an
+// event loop and the producer never waits.
+struct message
+{
+    int type;
+    int32_t a, b;
+};
+
+struct message_queue;
+
+// capacity is rounded up to a power of two, returns NULL on failure
+struct message_queue *message_queue_create(int capacity);
+
+void message_queue_destroy(struct message_queue *queue);
+
+// Readable while messages are queued
+int message_queue_fd(const struct message_queue *queue);
+
+// Producer thread only, returns -1 if the queue is full and -2 if the consumer could not be woken up.
+// The message is not queued either way
+int message_queue_push(struct message_queue *queue, const struct message *msg);
+
+// Consumer thread only, returns 0 with nothing queued
+int message_queue_pop(struct message_queue *queue, struct message *msg);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct wl_shm;
+struct wl_buffer;
+
+// = Shared memory frames =
+// Whole frames handed to the compositor as wl_shm buffers, so a cached loop can be played back
+// without a GL context. All buffers live in a single memfd shared with the compositor.
+struct shm_frame
+{
+    struct wl_buffer *buffer;
+    unsigned char *data; // w * h * 4 bytes, rows top to bottom
+    int busy;            // Attached to the surface and not released by the compositor yet
+};
+
+struct shm_frames
+{
+    int count;
+    int w, h;
+    size_t size; // Of the whole mapping
+    void *map;
+    struct shm_frame frames[];
+};
+
+// format is a WL_SHM_FORMAT_* code with 4 bytes per pixel, returns NULL if the pool couldn't be created
+struct shm_frames *shm_frames_create(struct wl_shm *shm, int w, int h, int count, uint32_t format);
+
+void shm_frames_destroy(struct shm_frames *frames);
+
+#endif
@@ -0,0 +1,243 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bundle.h"
+
+void debprintf(const char *format, ...);
+
+#define BUNDLE_MAGIC "VPBUNDL1"
+
+// Tracks start on page boundaries so each could be mapped on its own
+#define BUNDLE_TRACK_ALIGN 4096
+
+struct bundle_header
+{
+    char magic[8];
+    uint64_t shader_hash;
+    int32_t fps;
+    int32_t cache_seconds;
+    int32_t track_count;
+    int32_t reserved;
+    uint64_t source_offset, source_size; // Both NUL terminated, sizes include it
+    uint64_t shader_offset, shader_size;
+};
+
+// Follows the header, one per track
+struct bundle_track_entry
+{
+    uint64_t offset; // From the start of the file
+    uint64_t size;
+    int32_t width, height; // Output size it was baked for
+    uint32_t codec;
+    int32_t quality;
+    int32_t delta;
+    int32_t mem_budget;
+};
+
+struct bundle
+{
+    void *map;
+    size_t size;
+    const struct bundle_track_entry *tracks;
+    struct bundle_info info;
+};
+
+static int write_padding(FILE *f, uint64_t align)
+{
+    long pos = ftell(f);
+    if (pos < 0)
+        return -1;
+    for (uint64_t p = (uint64_t)pos; p % align; p++)
+    {
+        if (fputc(0, f) == EOF)
+            return -1;
+    }
+    return 0;
+}
+
+int bundle_write(const char *path, const char *source, const char *shader, int fps, int cache_seconds,
+                 const struct bundle_track *tracks, int track_count)
+{
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, (long)getpid());
+
+    FILE *f = fopen(tmp_path, "wb");
+    if (!f)
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", tmp_path, strerror(errno));
+        return -1;
+    }
+
+    struct bundle_header header = {0};
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+    header.shader_hash = cache_hash(CACHE_HASH_INIT, shader, strlen(shader));
+    header.fps = fps;
+    header.cache_seconds = cache_seconds;
+    header.track_count = track_count;
+    header.source_offset = sizeof(header) + (uint64_t)track_count * sizeof(struct bundle_track_entry);
+    header.source_size = strlen(source) + 1;
+    header.shader_offset = header.source_offset + header.source_size;
+    header.shader_size = strlen(shader) + 1;
+
+    struct bundle_track_entry *entries = calloc(track_count > 0 ? track_count : 1, sizeof(struct bundle_track_entry));
+    int ok = entries != NULL;
+
+    // The header and the index are written again once the track offsets are known
+    ok = ok && fwrite(&header, sizeof(header), 1, f) == 1;
+    ok = ok && fwrite(entries, sizeof(struct bundle_track_entry), track_count, f) == (size_t)track_count;
+    ok = ok && fwrite(source, 1, header.source_size, f) == header.source_size;
+    ok = ok && fwrite(shader, 1, header.shader_size, f) == header.shader_size;
+
+    for (int i = 0; ok && i < track_count; i++)
+    {
+        const struct cache_key *key = tracks[i].key;
+        ok = write_padding(f, BUNDLE_TRACK_ALIGN) == 0;
+        entries[i].offset = ok ? (uint64_t)ftell(f) : 0;
+        entries[i].width = key->width;
+        entries[i].height = key->height;
+        entries[i].codec = key->codec;
+        entries[i].quality = key->quality;
+        entries[i].delta = key->delta;
+        entries[i].mem_budget = key->mem_budget;
+        ok = ok && cache_write(f, key, tracks[i].format, tracks[i].frames, tracks[i].frame_count, &entries[i].size) == 0;
+    }
+
+    ok = ok && fseek(f, 0, SEEK_SET) == 0;
+    ok = ok && fwrite(&header, sizeof(header), 1, f) == 1;
+    ok = ok && fwrite(entries, sizeof(struct bundle_track_entry), track_count, f) == (size_t)track_count;
+    free(entries);
+
+    if (fclose(f) != 0)
+        ok = 0;
+    if (!ok || rename(tmp_path, path) != 0)
+    {
+        fprintf(stderr, "Failed to write bundle %s\n", path);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    debprintf("Wrote %d tracks to %s\n", track_count, path);
+    return 0;
+}
+
+// Whether [offset, offset + size) lies within the bundle
+static int bundle_range_ok(const struct bundle *bundle, uint64_t offset, uint64_t size)
+{
+    return offset <= bundle->size && size <= bundle->size - offset;
+}
+
+struct bundle *bundle_open(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    char magic[8];
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct bundle_header) || pread(fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+        memcmp(magic, BUNDLE_MAGIC, sizeof(magic)) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    struct bundle *bundle = calloc(1, sizeof(struct bundle));
+    if (!bundle)
+    {
+        close(fd);
+        return NULL;
+    }
+    bundle->size = st.st_size;
+    bundle->map = mmap(NULL, bundle->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping keeps the file alive
+    if (bundle->map == MAP_FAILED)
+    {
+        free(bundle);
+        return NULL;
+    }
+
+    const struct bundle_header *header = bundle->map;
+    const char *base = bundle->map;
+    bundle->tracks = (const struct bundle_track_entry *)(base + sizeof(*header));
+    int ok = header->track_count >= 0 && header->fps > 1 && header->cache_seconds >= 0 &&
+             bundle_range_ok(bundle, sizeof(*header), (uint64_t)header->track_count * sizeof(struct bundle_track_entry)) &&
+             header->source_size > 0 && bundle_range_ok(bundle, header->source_offset, header->source_size) &&
+             header->shader_size > 0 && bundle_range_ok(bundle, header->shader_offset, header->shader_size) &&
+             base[header->source_offset + header->source_size - 1] == '\0' && base[header->shader_offset + header->shader_size - 1] == '\0';
+    for (int i = 0; ok && i < header->track_count; i++)
+        ok = bundle_range_ok(bundle, bundle->tracks[i].offset, bundle->tracks[i].size);
+    if (!ok)
+    {
+        fprintf(stderr, "Bundle %s is damaged\n", path);
+        bundle_close(bundle);
+        return NULL;
+    }
+
+    bundle->info.source = base + header->source_offset;
+    bundle->info.shader = base + header->shader_offset;
+    bundle->info.shader_hash = header->shader_hash;
+    bundle->info.fps = header->fps;
+    bundle->info.cache_seconds = header->cache_seconds;
+    bundle->info.track_count = header->track_count;
+
+    debprintf("Mapped bundle %s, %d tracks at %d fps\n", path, header->track_count, header->fps);
+    return bundle;
+}
+
+const struct bundle_info *bundle_get_info(const struct bundle *bundle)
+{
+    return &bundle->info;
+}
+
+int bundle_find_track(const struct bundle *bundle, int w, int h)
+{
+    int best = -1;
+    for (int i = 0; i < bundle->info.track_count; i++)
+    {
+        const struct bundle_track_entry *track = &bundle->tracks[i];
+        if (track->width == w && track->height == h)
+            return i;
+        if (best < 0 || (int64_t)track->width * track->height > (int64_t)bundle->tracks[best].width * bundle->tracks[best].height)
+            best = i;
+    }
+    return best;
+}
+
+int bundle_load_track(const struct bundle *bundle, int track, struct cached_frame *frames, int max_frames, int *frame_count,
+                      struct cache_key *key, struct cache_format *format)
+{
+    const struct bundle_track_entry *entry = &bundle->tracks[track];
+    memset(key, 0, sizeof(*key));
+    key->shader_hash = bundle->info.shader_hash;
+    key->width = entry->width;
+    key->height = entry->height;
+    key->fps = bundle->info.fps;
+    key->cache_seconds = bundle->info.cache_seconds;
+    key->codec = entry->codec;
+    key->quality = entry->quality;
+    key->delta = entry->delta;
+    key->mem_budget = entry->mem_budget;
+
+    char name[64];
+    snprintf(name, sizeof(name), "bundle track %d", track);
+    if (cache_parse((const char *)bundle->map + entry->offset, entry->size, name, key, frames, max_frames, frame_count, format) != 0)
+        return -1;
+
+    debprintf("Playing bundle track %d, baked for %dx%d\n", track, entry->width, entry->height);
+    return 0;
+}
+
+void bundle_close(struct bundle *bundle)
+{
+    if (!bundle)
+        return;
+    munmap(bundle->map, bundle->size);
+    free(bundle);
+}
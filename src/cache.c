@@ -0,0 +1,1263 @@
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE // MAP_ANONYMOUS, MADV_HUGEPAGE, memfd_create and file seals
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+
+#include "cache.h"
+#include "codec.h"
+
+void debprintf(const char *format, ...);
+
+// Low power playback drops the decode resolution once decoding takes this share of a frame's time,
+// and raises it again after this many frames in a row in which the bigger size would have taken under half that
+#define LOW_POWER_BUSY 0.8
+#define LOW_POWER_RECOVER_FRAMES 120
+#define LOW_POWER_MAX_SCALE 8
+
+// Arena chunks are mapped this big, or bigger for a frame that doesn't fit
+#define ARENA_CHUNK_SIZE (64 << 20)
+#define ARENA_HUGE_PAGE_SIZE (2 << 20)
+#define ARENA_ALIGN 64
+
+struct arena_chunk
+{
+    struct arena_chunk *next;
+    size_t size; // Whole mapping, this header included
+    size_t used;
+};
+
+struct frame_arena
+{
+    pthread_mutex_t lock;
+    struct arena_chunk *chunks; // Newest first, allocations come from the head
+    int huge_pages;
+};
+
+struct frame_arena *frame_arena_create(int huge_pages)
+{
+    struct frame_arena *arena = calloc(1, sizeof(struct frame_arena));
+    if (!arena)
+        return NULL;
+    pthread_mutex_init(&arena->lock, NULL);
+    arena->huge_pages = huge_pages;
+    return arena;
+}
+
+static struct arena_chunk *arena_map_chunk(struct frame_arena *arena, size_t min_size)
+{
+    size_t size = min_size > ARENA_CHUNK_SIZE ? min_size : ARENA_CHUNK_SIZE;
+    size = (size + ARENA_HUGE_PAGE_SIZE - 1) & ~(size_t)(ARENA_HUGE_PAGE_SIZE - 1);
+
+    // Over-map so the chunk can start on a huge page boundary, then trim the slack
+    size_t map_size = size + ARENA_HUGE_PAGE_SIZE;
+    char *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    char *start = (char *)(((uintptr_t)map + ARENA_HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(ARENA_HUGE_PAGE_SIZE - 1));
+    if (start > map)
+        munmap(map, start - map);
+    if (start + size < map + map_size)
+        munmap(start + size, map + map_size - (start + size));
+
+#ifdef MADV_HUGEPAGE
+    if (arena->huge_pages && madvise(start, size, MADV_HUGEPAGE) != 0)
+    {
+        debprintf("Transparent huge pages unavailable: %s\n", strerror(errno));
+    }
+#endif
+
+    struct arena_chunk *chunk = (struct arena_chunk *)start;
+    chunk->size = size;
+    chunk->used = (sizeof(struct arena_chunk) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    return chunk;
+}
+
+void *frame_arena_alloc(struct frame_arena *arena, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    pthread_mutex_lock(&arena->lock);
+    struct arena_chunk *chunk = arena->chunks;
+    if (!chunk || chunk->size - chunk->used < size)
+    {
+        chunk = arena_map_chunk(arena, size + sizeof(struct arena_chunk) + ARENA_ALIGN);
+        if (!chunk)
+        {
+            pthread_mutex_unlock(&arena->lock);
+            return NULL;
+        }
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+    void *ptr = (char *)chunk + chunk->used;
+    chunk->used += size;
+    pthread_mutex_unlock(&arena->lock);
+    return ptr;
+}
+
+void frame_arena_destroy(struct frame_arena *arena)
+{
+    if (!arena)
+        return;
+
+    size_t used = 0, mapped = 0;
+    while (arena->chunks)
+    {
+        struct arena_chunk *chunk = arena->chunks;
+        arena->chunks = chunk->next;
+        used += chunk->used;
+        mapped += chunk->size;
+        munmap(chunk, chunk->size);
+    }
+    debprintf("Freed frame arena, %zu of %zu bytes used\n", used, mapped);
+
+    pthread_mutex_destroy(&arena->lock);
+    free(arena);
+}
+
+// Buffers per worker, one being encoded and one waiting in the queue
+#define ENCODE_BUFFERS_PER_WORKER 2
+
+struct encode_job
+{
+    unsigned char *rgba;
+    int frame_index;
+    int tile_count; // -1 for a keyframe
+    uint32_t *tiles;
+};
+
+struct encode_pool
+{
+    int w, h;
+    const struct frame_codec_ops *codec;
+    int quality;
+    int delta;
+    struct frame_arena *arena;
+    struct cached_frame *frames;
+    struct codec_stats stats; // Summed over the workers as they exit
+
+    pthread_t *threads;
+    int worker_count;
+    int max_tiles;
+
+    pthread_mutex_t lock;
+    pthread_cond_t job_ready;   // Signalled when a job is queued or the pool is stopping
+    pthread_cond_t buffer_free; // Signalled when a worker returns a buffer
+    pthread_cond_t idle;        // Signalled when the last in-flight job finishes
+
+    // RGBA buffers, every buffer is either on the free stack, in the job queue or being encoded
+    unsigned char **buffers;
+    unsigned char **free_buffers;
+    int buffer_count;
+    int free_count;
+
+    // Job ring, can never hold more jobs than there are buffers
+    struct encode_job *jobs;
+    int job_head;
+    int job_count;
+
+    int in_flight; // Queued + being encoded
+    int failed;
+    int stopping;
+};
+
+static void *encode_worker(void *arg)
+{
+    struct encode_pool *pool = arg;
+
+    // Each worker keeps its own codec state for the whole cache build
+    struct frame_codec *codec = frame_codec_create(pool->codec);
+    uint32_t *tiles = malloc((size_t)pool->max_tiles * sizeof(uint32_t));
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
+    {
+        while (pool->job_count == 0 && !pool->stopping)
+            pthread_cond_wait(&pool->job_ready, &pool->lock);
+
+        if (pool->job_count == 0) // Stopping and nothing left to do
+            break;
+
+        // The queue slot can be reused as soon as it is popped, so take a copy of the tile list
+        struct encode_job job = pool->jobs[pool->job_head];
+        if (job.tile_count > 0 && tiles)
+            memcpy(tiles, job.tiles, (size_t)job.tile_count * sizeof(uint32_t));
+        pool->job_head = (pool->job_head + 1) % pool->buffer_count;
+        pool->job_count--;
+        pthread_mutex_unlock(&pool->lock);
+
+        size_t size = 0;
+        unsigned char *data = NULL;
+        const unsigned char *encoded = NULL;
+        if (codec && !pool->delta)
+            encoded = frame_codec_encode(codec, job.rgba, pool->w, pool->h, pool->quality, &size);
+        else if (codec && tiles)
+            encoded = delta_encode(codec, job.rgba, pool->w, pool->h, pool->quality, tiles, job.tile_count, &size);
+        if (encoded)
+        {
+            // The scratch buffer is reused for the next frame, keep an exact sized copy
+            data = frame_arena_alloc(pool->arena, size);
+            if (data)
+                memcpy(data, encoded, size);
+        }
+
+        // Each frame index is written by exactly one worker, no lock needed
+        pool->frames[job.frame_index].data = data;
+        pool->frames[job.frame_index].size = size;
+        if (data)
+        {
+            debprintf("Cached frame %d: %zu bytes (%s)\n", job.frame_index, size, pool->codec->name);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (!data)
+            pool->failed = 1;
+        pool->free_buffers[pool->free_count++] = job.rgba;
+        pthread_cond_signal(&pool->buffer_free);
+        if (--pool->in_flight == 0)
+            pthread_cond_broadcast(&pool->idle);
+    }
+    if (codec)
+        codec_stats_add(&pool->stats, frame_codec_stats(codec));
+    pthread_mutex_unlock(&pool->lock);
+
+    frame_codec_destroy(codec);
+    free(tiles);
+    return NULL;
+}
+
+struct encode_pool *encode_pool_create(int workers, int w, int h, const struct frame_codec_ops *codec, int quality, int delta,
+                                       struct frame_arena *arena, struct cached_frame *frames)
+{
+    if (workers <= 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 1 ? (int)cpus - 1 : 1; // Leave one core to the render thread
+    }
+
+    struct encode_pool *pool = calloc(1, sizeof(struct encode_pool));
+    if (!pool)
+        return NULL;
+
+    pool->w = w;
+    pool->h = h;
+    pool->codec = codec;
+    pool->quality = quality;
+    pool->delta = delta;
+    pool->arena = arena;
+    pool->frames = frames;
+    pool->buffer_count = workers * ENCODE_BUFFERS_PER_WORKER;
+    pool->max_tiles = delta_tile_count(w, h);
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->job_ready, NULL);
+    pthread_cond_init(&pool->buffer_free, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    pool->buffers = calloc(pool->buffer_count, sizeof(unsigned char *));
+    pool->free_buffers = calloc(pool->buffer_count, sizeof(unsigned char *));
+    pool->jobs = calloc(pool->buffer_count, sizeof(struct encode_job));
+    pool->threads = calloc(workers, sizeof(pthread_t));
+    if (!pool->buffers || !pool->free_buffers || !pool->jobs || !pool->threads)
+    {
+        encode_pool_destroy(pool);
+        return NULL;
+    }
+    for (int i = 0; i < pool->buffer_count; i++)
+    {
+        pool->jobs[i].tiles = malloc((size_t)pool->max_tiles * sizeof(uint32_t));
+        if (!pool->jobs[i].tiles)
+        {
+            encode_pool_destroy(pool);
+            return NULL;
+        }
+    }
+
+    for (int i = 0; i < pool->buffer_count; i++)
+    {
+        pool->buffers[i] = malloc((size_t)w * h * 4);
+        if (!pool->buffers[i])
+        {
+            encode_pool_destroy(pool);
+            return NULL;
+        }
+        pool->free_buffers[pool->free_count++] = pool->buffers[i];
+    }
+
+    for (int i = 0; i < workers; i++)
+    {
+        if (pthread_create(&pool->threads[i], NULL, encode_worker, pool) != 0)
+        {
+            perror("pthread_create");
+            break;
+        }
+        pool->worker_count++;
+    }
+    if (pool->worker_count == 0)
+    {
+        encode_pool_destroy(pool);
+        return NULL;
+    }
+
+    debprintf("Started %d %s encoder threads with %d frame buffers\n", pool->worker_count, codec->name, pool->buffer_count);
+    return pool;
+}
+
+unsigned char *encode_pool_acquire(struct encode_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->free_count == 0)
+        pthread_cond_wait(&pool->buffer_free, &pool->lock);
+    unsigned char *rgba = pool->free_buffers[--pool->free_count];
+    pthread_mutex_unlock(&pool->lock);
+    return rgba;
+}
+
+void encode_pool_submit(struct encode_pool *pool, unsigned char *rgba, int frame_index, const uint32_t *tiles, int tile_count)
+{
+    pthread_mutex_lock(&pool->lock);
+    int tail = (pool->job_head + pool->job_count) % pool->buffer_count;
+    pool->jobs[tail].rgba = rgba;
+    pool->jobs[tail].frame_index = frame_index;
+    pool->jobs[tail].tile_count = tile_count;
+    if (tile_count > 0)
+        memcpy(pool->jobs[tail].tiles, tiles, (size_t)tile_count * sizeof(uint32_t));
+    pool->job_count++;
+    pool->in_flight++;
+    pthread_cond_signal(&pool->job_ready);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void encode_pool_discard(struct encode_pool *pool, unsigned char *rgba)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->free_buffers[pool->free_count++] = rgba;
+    pthread_cond_signal(&pool->buffer_free);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int encode_pool_finish(struct encode_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->in_flight > 0)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    int failed = pool->failed;
+    pthread_mutex_unlock(&pool->lock);
+    return failed ? -1 : 0;
+}
+
+void encode_pool_destroy(struct encode_pool *pool)
+{
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->job_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->worker_count; i++)
+        pthread_join(pool->threads[i], NULL);
+    if (pool->worker_count > 0)
+        codec_stats_print(pool->codec, &pool->stats);
+
+    if (pool->buffers)
+    {
+        for (int i = 0; i < pool->buffer_count; i++)
+            free(pool->buffers[i]);
+    }
+    if (pool->jobs)
+    {
+        for (int i = 0; i < pool->buffer_count; i++)
+            free(pool->jobs[i].tiles);
+    }
+    free(pool->buffers);
+    free(pool->free_buffers);
+    free(pool->jobs);
+    free(pool->threads);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->job_ready);
+    pthread_cond_destroy(&pool->buffer_free);
+    pthread_cond_destroy(&pool->idle);
+    free(pool);
+}
+
+struct decode_slot
+{
+    unsigned char *data;
+    uint32_t *tiles;
+    struct decoded_frame frame;
+};
+
+struct decode_ring
+{
+    int w, h;
+    const struct frame_codec_ops *codec;
+    int delta;
+    enum frame_format format;
+    int threads; // Per frame, for codecs that can split one
+    const struct cached_frame *frames;
+    int frame_count;
+
+    pthread_t thread;
+    int thread_started;
+
+    pthread_mutex_t lock;
+    pthread_cond_t slot_filled; // Signalled by the decoder when a frame is ready
+    pthread_cond_t slot_free;   // Signalled by playback when a frame has been uploaded
+
+    struct decode_slot *slots;
+    int depth;
+    int head;   // Next slot the decoder fills
+    int tail;   // Next slot playback reads
+    int filled; // Decoded slots not yet released
+    int taken;  // Filled slots handed to playback by decode_ring_next and not yet released
+    int stopping;
+    int external; // Slot buffers belong to the caller, see decode_ring_create_into
+    int seek_to;  // Frame the decoder continues from, -1 to carry on in order
+
+    double frame_time; // Low power mode deadline, 0 when off
+
+    // Low power state, only touched by the decoder thread once it runs
+    int scale;
+    double decode_average; // Seconds per frame at the current scale, 0 until measured
+    int calm_frames;       // Frames in a row that would have fit at the next bigger size
+};
+
+static double ring_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Picks the scale for the next frame from how long this one took to decode
+static void adapt_decode_scale(struct decode_ring *ring, double seconds, double frame_time)
+{
+    ring->decode_average = ring->decode_average > 0 ? ring->decode_average * 0.9 + seconds * 0.1 : seconds;
+
+    if (ring->decode_average > LOW_POWER_BUSY * frame_time && ring->scale < LOW_POWER_MAX_SCALE)
+    {
+        ring->scale *= 2;
+        debprintf("Decoding takes %.1f ms of a %.1f ms frame, dropping to 1/%d resolution\n", ring->decode_average * 1e3,
+                  frame_time * 1e3, ring->scale);
+    }
+    else if (ring->scale > 1 && ring->decode_average * 4 < LOW_POWER_BUSY * frame_time / 2)
+    {
+        // Twice the width and height is about four times the work
+        if (++ring->calm_frames < LOW_POWER_RECOVER_FRAMES)
+            return;
+        ring->scale /= 2;
+        if (ring->scale > 1)
+            debprintf("Decoding has time to spare, going back up to 1/%d resolution\n", ring->scale);
+        else
+            debprintf("Decoding has time to spare, going back up to full resolution\n");
+    }
+    else
+    {
+        ring->calm_frames = 0;
+        return;
+    }
+    ring->decode_average = 0;
+    ring->calm_frames = 0;
+}
+
+static void *decode_worker(void *arg)
+{
+    struct decode_ring *ring = arg;
+    int next_frame = 0;
+
+    struct frame_codec *codec = frame_codec_create(ring->codec);
+    if (codec && ring->threads > 1 && frame_codec_set_threads(codec, ring->threads) != 0)
+    {
+        debprintf("%s can't decode a frame on %d threads, using one\n", ring->codec->name, ring->threads);
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    for (;;)
+    {
+        while (ring->filled == ring->depth && !ring->stopping)
+            pthread_cond_wait(&ring->slot_free, &ring->lock);
+        if (ring->stopping)
+            break;
+
+        if (ring->seek_to >= 0)
+        {
+            // Playback fell behind, unless the frame it wants is already decoded and waiting
+            int ready = 0;
+            for (int i = ring->taken; i < ring->filled; i++)
+                ready |= ring->slots[(ring->tail + i) % ring->depth].frame.frame_idx == ring->seek_to;
+            if (!ready && next_frame != ring->seek_to)
+            {
+                debprintf("Decoder skipping from frame %d to %d\n", next_frame, ring->seek_to);
+                next_frame = ring->seek_to;
+            }
+            ring->seek_to = -1;
+        }
+
+        // The head slot is not visible to playback until filled is bumped
+        struct decode_slot *slot = &ring->slots[ring->head];
+        double frame_time = ring->frame_time;
+        pthread_mutex_unlock(&ring->lock);
+
+        const struct cached_frame *frame = &ring->frames[next_frame];
+        int ok;
+        double start = ring_now();
+        slot->frame.frame_idx = next_frame;
+        slot->frame.tile_count = -1;
+        slot->frame.scale = ring->scale;
+        if (!codec)
+            ok = 0;
+        else if (ring->scale > 1)
+            ok = frame_codec_decode_scaled(codec, frame->data, frame->size, ring->w, ring->h, ring->scale, slot->data) == 0;
+        else if (ring->format == FRAME_YUV420)
+            ok = frame_codec_decode_yuv(codec, frame->data, frame->size, ring->w, ring->h, slot->data) == 0;
+        else if (ring->delta)
+            ok = delta_decode(codec, frame->data, frame->size, ring->w, ring->h, slot->data, slot->tiles, &slot->frame.tile_count) == 0;
+        else
+            ok = frame_codec_decode(codec, frame->data, frame->size, ring->w, ring->h, slot->data) == 0;
+        slot->frame.pixels = ok ? slot->data : NULL;
+        if (!ok)
+        {
+            debprintf("Failed to decode cached frame %d\n", next_frame);
+        }
+        else if (frame_time > 0)
+        {
+            adapt_decode_scale(ring, ring_now() - start, frame_time);
+        }
+        next_frame = (next_frame + 1) % ring->frame_count;
+
+        pthread_mutex_lock(&ring->lock);
+        ring->head = (ring->head + 1) % ring->depth;
+        ring->filled++;
+        pthread_cond_signal(&ring->slot_filled);
+    }
+    pthread_mutex_unlock(&ring->lock);
+
+    if (codec)
+        codec_stats_print(ring->codec, frame_codec_stats(codec));
+    frame_codec_destroy(codec);
+    return NULL;
+}
+
+static struct decode_ring *ring_create(int depth, int w, int h, const struct frame_codec_ops *codec, int delta, enum frame_format format,
+                                       int threads, unsigned char *const *buffers, const struct cached_frame *frames, int frame_count)
+{
+    struct decode_ring *ring = calloc(1, sizeof(struct decode_ring));
+    if (!ring)
+        return NULL;
+
+    ring->w = w;
+    ring->h = h;
+    ring->codec = codec;
+    ring->delta = delta;
+    ring->format = format;
+    ring->frames = frames;
+    ring->frame_count = frame_count;
+    ring->depth = depth < 1 ? 1 : depth;
+    ring->scale = 1;
+    ring->external = buffers != NULL;
+    ring->seek_to = -1;
+    if (threads <= 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 1 ? (int)cpus : 1;
+    }
+    ring->threads = threads;
+
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->slot_filled, NULL);
+    pthread_cond_init(&ring->slot_free, NULL);
+
+    ring->slots = calloc(ring->depth, sizeof(struct decode_slot));
+    if (!ring->slots)
+    {
+        decode_ring_destroy(ring);
+        return NULL;
+    }
+
+    size_t slot_size = delta_frame_capacity(w, h);
+    if (format == FRAME_YUV420)
+    {
+        struct yuv_layout layout;
+        jpeg_yuv_layout(w, h, &layout);
+        slot_size = layout.total_size;
+    }
+    for (int i = 0; i < ring->depth; i++)
+    {
+        ring->slots[i].data = buffers ? buffers[i] : malloc(slot_size);
+        ring->slots[i].tiles = malloc((size_t)delta_tile_count(w, h) * sizeof(uint32_t));
+        ring->slots[i].frame.tiles = ring->slots[i].tiles;
+        if (!ring->slots[i].data || !ring->slots[i].tiles)
+        {
+            decode_ring_destroy(ring);
+            return NULL;
+        }
+    }
+
+    if (pthread_create(&ring->thread, NULL, decode_worker, ring) != 0)
+    {
+        perror("pthread_create");
+        decode_ring_destroy(ring);
+        return NULL;
+    }
+    ring->thread_started = 1;
+
+    debprintf("Started %s decoder thread, %d frames ahead, %d threads per frame\n", codec->name, ring->depth, ring->threads);
+    return ring;
+}
+
+struct decode_ring *decode_ring_create(int depth, int w, int h, const struct frame_codec_ops *codec, int delta, enum frame_format format,
+                                       int threads, const struct cached_frame *frames, int frame_count)
+{
+    return ring_create(depth, w, h, codec, delta, format, threads, NULL, frames, frame_count);
+}
+
+struct decode_ring *decode_ring_create_into(int depth, int w, int h, const struct frame_codec_ops *codec, int threads,
+                                            unsigned char *const *buffers, const struct cached_frame *frames, int frame_count)
+{
+    return ring_create(depth, w, h, codec, 0, FRAME_RGBA, threads, buffers, frames, frame_count);
+}
+
+const struct decoded_frame *decode_ring_next(struct decode_ring *ring)
+{
+    pthread_mutex_lock(&ring->lock);
+    if (ring->filled == ring->taken)
+    {
+        debprintf("Decoder fell behind playback\n");
+        while (ring->filled == ring->taken)
+            pthread_cond_wait(&ring->slot_filled, &ring->lock);
+    }
+    struct decode_slot *slot = &ring->slots[(ring->tail + ring->taken) % ring->depth];
+    ring->taken++;
+    pthread_mutex_unlock(&ring->lock);
+
+    return &slot->frame;
+}
+
+void decode_ring_release(struct decode_ring *ring)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->tail = (ring->tail + 1) % ring->depth;
+    ring->filled--;
+    ring->taken--;
+    pthread_cond_signal(&ring->slot_free);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+void decode_ring_seek(struct decode_ring *ring, int frame_idx)
+{
+    // Every delta frame builds on the one before
+    if (ring->delta || frame_idx < 0 || frame_idx >= ring->frame_count)
+        return;
+
+    pthread_mutex_lock(&ring->lock);
+    ring->seek_to = frame_idx;
+    pthread_mutex_unlock(&ring->lock);
+}
+
+int decode_ring_set_low_power(struct decode_ring *ring, double frame_time)
+{
+    // Delta tiles and YUV planes are always patched in at full size
+    if (!ring->codec->decode_scaled || ring->delta || ring->format != FRAME_RGBA)
+        return -1;
+
+    pthread_mutex_lock(&ring->lock);
+    ring->frame_time = frame_time;
+    pthread_mutex_unlock(&ring->lock);
+    return 0;
+}
+
+void decode_ring_destroy(struct decode_ring *ring)
+{
+    if (!ring)
+        return;
+
+    if (ring->thread_started)
+    {
+        pthread_mutex_lock(&ring->lock);
+        ring->stopping = 1;
+        pthread_cond_signal(&ring->slot_free);
+        pthread_mutex_unlock(&ring->lock);
+        pthread_join(ring->thread, NULL);
+    }
+
+    if (ring->slots)
+    {
+        for (int i = 0; i < ring->depth; i++)
+        {
+            if (!ring->external)
+                free(ring->slots[i].data);
+            free(ring->slots[i].tiles);
+        }
+    }
+    free(ring->slots);
+
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->slot_filled);
+    pthread_cond_destroy(&ring->slot_free);
+    free(ring);
+}
+
+#define CACHE_FILE_MAGIC "VPCACHE4"
+
+struct cache_file_header
+{
+    char magic[8];
+    uint64_t key_hash;
+    int32_t width, height;
+    int32_t fps;
+    int32_t cache_seconds;
+    uint32_t codec;
+    int32_t quality;
+    int32_t delta;
+    int32_t mem_budget;
+    int32_t frame_count;
+
+    // Not part of the key, read back as they were saved
+    int32_t frame_width, frame_height;
+    int32_t frame_quality;
+};
+
+// Follows the header, one per frame
+struct cache_file_entry
+{
+    uint64_t offset; // From the start of the file
+    uint64_t size;
+};
+
+struct cache_file
+{
+    void *map;
+    size_t size;
+};
+
+uint64_t cache_hash(uint64_t hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+uint64_t frame_hash(const void *data, size_t len)
+{
+    // Four independent multiply chains keep this close to memory speed, FNV-1a goes byte by byte
+    const uint64_t prime = 0x9e3779b97f4a7c15ULL;
+    uint64_t lanes[4] = {len, len ^ 0xa0761d6478bd642fULL, len ^ 0xe7037ed1a0b428dbULL, len ^ 0x8ebc6af09c88c6e3ULL};
+    const unsigned char *p = data;
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32)
+    {
+        for (int l = 0; l < 4; l++)
+        {
+            uint64_t word;
+            memcpy(&word, p + i + l * 8, sizeof(word));
+            lanes[l] = (lanes[l] ^ word) * prime;
+            lanes[l] ^= lanes[l] >> 29;
+        }
+    }
+
+    uint64_t hash = cache_hash(CACHE_HASH_INIT, p + i, len - i); // Tail
+    for (int l = 0; l < 4; l++)
+    {
+        hash = (hash ^ lanes[l]) * prime;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+static uint64_t cache_key_hash(const struct cache_key *key)
+{
+    // Field by field so struct padding never ends up in the hash
+    uint64_t hash = cache_hash(CACHE_HASH_INIT, &key->shader_hash, sizeof(key->shader_hash));
+    hash = cache_hash(hash, &key->width, sizeof(key->width));
+    hash = cache_hash(hash, &key->height, sizeof(key->height));
+    hash = cache_hash(hash, &key->fps, sizeof(key->fps));
+    hash = cache_hash(hash, &key->cache_seconds, sizeof(key->cache_seconds));
+    hash = cache_hash(hash, &key->codec, sizeof(key->codec));
+    hash = cache_hash(hash, &key->quality, sizeof(key->quality));
+    hash = cache_hash(hash, &key->delta, sizeof(key->delta));
+    hash = cache_hash(hash, &key->mem_budget, sizeof(key->mem_budget));
+    return hash;
+}
+
+static void cache_file_fill_header(struct cache_file_header *header, const struct cache_key *key, const struct cache_format *format,
+                                   int frame_count)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, CACHE_FILE_MAGIC, sizeof(header->magic));
+    header->key_hash = cache_key_hash(key);
+    header->width = key->width;
+    header->height = key->height;
+    header->fps = key->fps;
+    header->cache_seconds = key->cache_seconds;
+    header->codec = key->codec;
+    header->quality = key->quality;
+    header->delta = key->delta;
+    header->mem_budget = key->mem_budget;
+    header->frame_count = frame_count;
+    header->frame_width = format->width;
+    header->frame_height = format->height;
+    header->frame_quality = format->quality;
+}
+
+static int make_dir(const char *path)
+{
+    if (mkdir(path, 0700) != 0 && errno != EEXIST)
+    {
+        debprintf("Failed to create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int cache_file_path(const struct cache_key *key, char *out, size_t out_size)
+{
+    char dir[4096];
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    if (xdg && xdg[0] == '/')
+    {
+        snprintf(dir, sizeof(dir), "%s", xdg);
+    }
+    else
+    {
+        const char *home = getenv("HOME");
+        if (!home)
+            return -1;
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    }
+    if (make_dir(dir) != 0)
+        return -1;
+
+    size_t len = strlen(dir);
+    snprintf(dir + len, sizeof(dir) - len, "/vecpaper");
+    if (make_dir(dir) != 0)
+        return -1;
+
+    int n = snprintf(out, out_size, "%s/%016llx.cache", dir, (unsigned long long)cache_key_hash(key));
+    return n > 0 && (size_t)n < out_size ? 0 : -1;
+}
+
+// Maps a cache in the file format from fd (closing it) and points frames[] into it, name is only for messages
+static struct cache_file *cache_map_fd(int fd, const char *name, const struct cache_key *key, struct cached_frame *frames, int max_frames,
+                                       int *frame_count, struct cache_format *format)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct cache_file_header))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping keeps the file alive
+    if (map == MAP_FAILED)
+        return NULL;
+
+    struct cache_file *file = malloc(sizeof(struct cache_file));
+    if (!file || cache_parse(map, size, name, key, frames, max_frames, frame_count, format) != 0)
+    {
+        free(file);
+        munmap(map, size);
+        return NULL;
+    }
+    file->map = map;
+    file->size = size;
+
+    debprintf("Mapped %d cached frames (%zu bytes) from %s\n", *frame_count, size, name);
+    return file;
+}
+
+int cache_parse(const void *data, size_t size, const char *name, const struct cache_key *key, struct cached_frame *frames, int max_frames,
+                int *frame_count, struct cache_format *format)
+{
+    if (size < sizeof(struct cache_file_header))
+        return -1;
+
+    // Every field of the key is stored, so a hash collision can't load the wrong loop.
+    // Only the frame count may differ, a detected loop period makes it shorter
+    const struct cache_file_header *header = data;
+    int count = header->frame_count;
+    struct cache_format stored = {header->frame_width, header->frame_height, header->frame_quality};
+    struct cache_file_header expected;
+    cache_file_fill_header(&expected, key, &stored, count);
+    const struct cache_file_entry *entries = (const struct cache_file_entry *)((const char *)data + sizeof(expected));
+    size_t data_start = sizeof(expected) + (size_t)(count > 0 ? count : 0) * sizeof(struct cache_file_entry);
+    if (memcmp(data, &expected, sizeof(expected)) != 0 || count < 1 || count > max_frames || size < data_start ||
+        stored.width < 1 || stored.width > key->width || stored.height < 1 || stored.height > key->height)
+    {
+        debprintf("Cache %s does not match, ignoring it\n", name);
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (entries[i].offset < data_start || entries[i].offset > size || entries[i].size > size - entries[i].offset)
+        {
+            debprintf("Cache %s is truncated, ignoring it\n", name);
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        // Frames are only ever read, the mapping is read-only
+        frames[i].data = (unsigned char *)data + entries[i].offset;
+        frames[i].size = entries[i].size;
+        frames[i].source = i; // Duplicates share offsets, nothing here is freed on its own
+    }
+    *frame_count = count;
+    *format = stored;
+    return 0;
+}
+
+struct cache_file *cache_file_load(const char *path, const struct cache_key *key, struct cached_frame *frames, int max_frames,
+                                   int *frame_count, struct cache_format *format)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    return cache_map_fd(fd, path, key, frames, max_frames, frame_count, format);
+}
+
+int cache_write(FILE *f, const struct cache_key *key, const struct cache_format *format, const struct cached_frame *frames,
+                       int frame_count, uint64_t *size)
+{
+    struct cache_file_header header;
+    cache_file_fill_header(&header, key, format, frame_count);
+    int ok = fwrite(&header, sizeof(header), 1, f) == 1;
+
+    // Duplicates point at their source's data, which always comes earlier
+    uint64_t *offsets = malloc((size_t)frame_count * sizeof(uint64_t));
+    ok = ok && offsets;
+
+    uint64_t offset = sizeof(header) + (uint64_t)frame_count * sizeof(struct cache_file_entry);
+    for (int i = 0; ok && i < frame_count; i++)
+    {
+        if (frames[i].source != i)
+        {
+            offsets[i] = offsets[frames[i].source];
+        }
+        else
+        {
+            offsets[i] = offset;
+            offset += frames[i].size;
+        }
+        struct cache_file_entry entry = {offsets[i], frames[i].size};
+        ok = fwrite(&entry, sizeof(entry), 1, f) == 1;
+    }
+    for (int i = 0; ok && i < frame_count; i++)
+    {
+        if (frames[i].source == i)
+            ok = fwrite(frames[i].data, 1, frames[i].size, f) == frames[i].size;
+    }
+    free(offsets);
+
+    *size = offset;
+    return ok ? 0 : -1;
+}
+
+int cache_file_save(const char *path, const struct cache_key *key, const struct cache_format *format,
+                    const struct cached_frame *frames, int frame_count)
+{
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, (long)getpid());
+
+    FILE *f = fopen(tmp_path, "wb");
+    if (!f)
+    {
+        debprintf("Failed to open %s: %s\n", tmp_path, strerror(errno));
+        return -1;
+    }
+
+    uint64_t size;
+    int ok = cache_write(f, key, format, frames, frame_count, &size) == 0;
+    if (fclose(f) != 0)
+        ok = 0;
+    if (!ok || rename(tmp_path, path) != 0)
+    {
+        debprintf("Failed to write cache file %s\n", path);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    debprintf("Saved %d cached frames (%llu bytes) to %s\n", frame_count, (unsigned long long)size, path);
+    return 0;
+}
+
+void cache_file_unmap(struct cache_file *file)
+{
+    if (!file)
+        return;
+    munmap(file->map, file->size);
+    free(file);
+}
+
+// = Shared cache =
+
+// Seals a shared cache must carry, so it can't change size or contents under a mapping
+#define CACHE_SHARE_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+
+struct cache_share
+{
+    int listen_fd;
+    int memfd; // Sealed cache in the file format, sent to every instance that connects
+    struct cache_file *file;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    pthread_t thread;
+    int thread_started;
+};
+
+// Socket named after the key in $XDG_RUNTIME_DIR, instances with the same key meet there
+static int cache_share_address(const struct cache_key *key, struct sockaddr_un *addr)
+{
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    if (!runtime || runtime[0] != '/')
+        return -1;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    int n = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/vecpaper-%016llx.sock", runtime,
+                     (unsigned long long)cache_key_hash(key));
+    return n > 0 && (size_t)n < sizeof(addr->sun_path) ? 0 : -1;
+}
+
+// The socket path is only checked, cleared and bound while holding an flock on a lock file next to it,
+// so an instance between bind and listen never looks stale to another one. Returns the lock fd or -1
+static int cache_share_lock(const struct sockaddr_un *addr)
+{
+    char path[sizeof(addr->sun_path) + 8];
+    snprintf(path, sizeof(path), "%s.lock", addr->sun_path);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return -1;
+    while (flock(fd, LOCK_EX) != 0)
+    {
+        if (errno != EINTR)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd; // Closing it unlocks, the file itself stays so nobody locks a different one
+}
+
+static void *cache_share_worker(void *arg)
+{
+    struct cache_share *share = arg;
+    for (;;)
+    {
+        // cache_share_destroy shuts the socket down, which ends the wait
+        int client = accept4(share->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+
+        char byte = 0;
+        struct iovec iov = {&byte, 1};
+        union
+        {
+            char buf[CMSG_SPACE(sizeof(int))];
+            struct cmsghdr align;
+        } control;
+        struct msghdr msg = {0};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &share->memfd, sizeof(int));
+        if (sendmsg(client, &msg, MSG_NOSIGNAL) == 1)
+            debprintf("Sent the frame cache to another instance\n");
+        close(client);
+    }
+    return NULL;
+}
+
+struct cache_share *cache_share_publish(const struct cache_key *key, const struct cache_format *format, struct cached_frame *frames,
+                                        int frame_count)
+{
+    struct sockaddr_un addr;
+    if (cache_share_address(key, &addr) != 0)
+        return NULL;
+    int lock = cache_share_lock(&addr);
+    if (lock < 0)
+        return NULL;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        close(lock);
+        return NULL;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+    {
+        debprintf("Another instance already shares this cache\n");
+        close(fd);
+        close(lock);
+        return NULL;
+    }
+    if (errno == ECONNREFUSED)
+        unlink(addr.sun_path); // Under the lock nobody is between bind and listen, so it's left behind by a crash
+    close(fd);
+
+    struct cache_share *share = calloc(1, sizeof(struct cache_share));
+    if (!share)
+    {
+        close(lock);
+        return NULL;
+    }
+    share->listen_fd = -1;
+    share->memfd = memfd_create("vecpaper-cache", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    int write_fd = share->memfd >= 0 ? dup(share->memfd) : -1;
+    FILE *f = write_fd >= 0 ? fdopen(write_fd, "wb") : NULL;
+    if (!f && write_fd >= 0)
+        close(write_fd);
+    uint64_t size;
+    int ok = f && cache_write(f, key, format, frames, frame_count, &size) == 0;
+    if (f && fclose(f) != 0)
+        ok = 0;
+    if (!ok || fcntl(share->memfd, F_ADD_SEALS, CACHE_SHARE_SEALS) != 0)
+    {
+        debprintf("Failed to copy the cache into shared memory: %s\n", strerror(errno));
+        close(lock);
+        cache_share_destroy(share);
+        return NULL;
+    }
+
+    share->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (share->listen_fd < 0 || bind(share->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        // Most likely another instance got there first
+        debprintf("Can't share the cache on %s: %s\n", addr.sun_path, strerror(errno));
+        close(lock);
+        cache_share_destroy(share);
+        return NULL;
+    }
+    memcpy(share->path, addr.sun_path, sizeof(share->path));
+    int listening = listen(share->listen_fd, 8) == 0;
+    close(lock); // Listening now, so other instances can tell it is alive
+    if (!listening || pthread_create(&share->thread, NULL, cache_share_worker, share) != 0)
+    {
+        cache_share_destroy(share);
+        return NULL;
+    }
+    share->thread_started = 1;
+
+    // Playback reads the shared copy too, so the caller can drop its own
+    int count;
+    struct cache_format stored;
+    share->file = cache_map_fd(dup(share->memfd), share->path, key, frames, frame_count, &count, &stored);
+    if (!share->file)
+    {
+        cache_share_destroy(share);
+        return NULL;
+    }
+
+    debprintf("Sharing %llu cached bytes with other instances on %s\n", (unsigned long long)size, share->path);
+    return share;
+}
+
+void cache_share_destroy(struct cache_share *share)
+{
+    if (!share)
+        return;
+
+    // Held from before the socket stops accepting until it is gone, so another instance can't take it
+    // for stale and bind its own in between, only to have it unlinked here
+    struct sockaddr_un addr = {0};
+    int lock = -1;
+    if (share->path[0])
+    {
+        memcpy(addr.sun_path, share->path, sizeof(addr.sun_path));
+        lock = cache_share_lock(&addr);
+    }
+
+    if (share->thread_started)
+    {
+        shutdown(share->listen_fd, SHUT_RDWR);
+        pthread_join(share->thread, NULL);
+    }
+    if (share->path[0])
+        unlink(share->path);
+    if (share->listen_fd >= 0)
+        close(share->listen_fd);
+    if (lock >= 0)
+        close(lock);
+    if (share->memfd >= 0)
+        close(share->memfd);
+    cache_file_unmap(share->file);
+    free(share);
+}
+
+struct cache_file *cache_share_fetch(const struct cache_key *key, struct cached_frame *frames, int max_frames, int *frame_count,
+                                     struct cache_format *format)
+{
+    struct sockaddr_un addr;
+    if (cache_share_address(key, &addr) != 0)
+        return NULL;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return NULL;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    char byte;
+    struct iovec iov = {&byte, 1};
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    close(fd);
+
+    struct cmsghdr *cmsg = n == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+        return NULL;
+    int memfd;
+    memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+
+    // Without the seals the sender could still shrink the memory away under the mapping
+    if ((fcntl(memfd, F_GET_SEALS) & CACHE_SHARE_SEALS) != CACHE_SHARE_SEALS)
+    {
+        debprintf("Shared cache on %s isn't sealed, ignoring it\n", addr.sun_path);
+        close(memfd);
+        return NULL;
+    }
+    return cache_map_fd(memfd, addr.sun_path, key, frames, max_frames, frame_count, format);
+}
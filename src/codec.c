@@ -0,0 +1,447 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "codec.h"
+
+void debprintf(const char *format, ...);
+
+// Raw storage, frames are kept exactly as read back. Costs the most memory but nothing to decode
+static void *raw_create(void)
+{
+    static int dummy; // No state, but NULL means failure
+    return &dummy;
+}
+
+static void raw_destroy(void *state)
+{
+    (void)state;
+}
+
+static const unsigned char *raw_encode(void *state, const unsigned char *rgba, int w, int h, int quality, size_t *out_size)
+{
+    (void)state;
+    (void)quality;
+    *out_size = (size_t)w * h * 4;
+    return rgba; // Callers copy the result out before touching the frame again
+}
+
+static int raw_decode(void *state, const unsigned char *data, size_t size, int w, int h, unsigned char *rgba)
+{
+    (void)state;
+    if (size != (size_t)w * h * 4)
+        return -1;
+    memcpy(rgba, data, size);
+    return 0;
+}
+
+const struct frame_codec_ops raw_frame_codec = {
+    .id = 3,
+    .name = "raw",
+    .lossy = 0,
+    .has_quality = 0,
+    .create = raw_create,
+    .destroy = raw_destroy,
+    .encode = raw_encode,
+    .decode = raw_decode,
+};
+
+static const struct frame_codec_ops *const frame_codecs[] = {
+    &jpeg_frame_codec,
+    &qoi_frame_codec,
+    &raw_frame_codec,
+    &etc2_frame_codec,
+};
+
+#define FRAME_CODEC_COUNT (sizeof(frame_codecs) / sizeof(frame_codecs[0]))
+
+const struct frame_codec_ops *frame_codec_find(const char *name)
+{
+    for (size_t i = 0; i < FRAME_CODEC_COUNT; i++)
+    {
+        if (strcmp(frame_codecs[i]->name, name) == 0)
+            return frame_codecs[i];
+    }
+    return NULL;
+}
+
+const struct frame_codec_ops *frame_codec_find_id(uint32_t id)
+{
+    for (size_t i = 0; i < FRAME_CODEC_COUNT; i++)
+    {
+        if (frame_codecs[i]->id == id)
+            return frame_codecs[i];
+    }
+    return NULL;
+}
+
+const struct frame_codec_ops *frame_codec_at(size_t index)
+{
+    return index < FRAME_CODEC_COUNT ? frame_codecs[index] : NULL;
+}
+
+struct frame_codec
+{
+    const struct frame_codec_ops *ops;
+    void *state;
+    struct codec_stats stats;
+
+    // Changed tiles of a delta frame packed into one image
+    unsigned char *strip;
+    size_t strip_capacity;
+
+    // Delta header followed by the codec output
+    unsigned char *delta;
+    size_t delta_capacity;
+};
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int reserve(unsigned char **buffer, size_t *capacity, size_t size)
+{
+    if (size <= *capacity)
+        return 0;
+
+    unsigned char *grown = realloc(*buffer, size);
+    if (!grown)
+        return -1;
+    *buffer = grown;
+    *capacity = size;
+    return 0;
+}
+
+struct frame_codec *frame_codec_create(const struct frame_codec_ops *ops)
+{
+    struct frame_codec *codec = calloc(1, sizeof(struct frame_codec));
+    if (!codec)
+        return NULL;
+
+    codec->ops = ops;
+    codec->state = ops->create();
+    if (!codec->state)
+    {
+        free(codec);
+        return NULL;
+    }
+    return codec;
+}
+
+void frame_codec_destroy(struct frame_codec *codec)
+{
+    if (!codec)
+        return;
+
+    codec->ops->destroy(codec->state);
+    free(codec->strip);
+    free(codec->delta);
+    free(codec);
+}
+
+const unsigned char *frame_codec_encode(struct frame_codec *codec, const unsigned char *rgba, int w, int h, int quality, size_t *out_size)
+{
+    double start = now_seconds();
+    const unsigned char *encoded = codec->ops->encode(codec->state, rgba, w, h, quality, out_size);
+    codec->stats.encode_seconds += now_seconds() - start;
+
+    if (encoded)
+    {
+        codec->stats.frames_encoded++;
+        codec->stats.raw_bytes += (uint64_t)w * h * 4;
+        codec->stats.encoded_bytes += *out_size;
+    }
+    return encoded;
+}
+
+int frame_codec_decode(struct frame_codec *codec, const unsigned char *data, size_t size, int w, int h, unsigned char *rgba)
+{
+    double start = now_seconds();
+    int ret = codec->ops->decode(codec->state, data, size, w, h, rgba);
+    codec->stats.decode_seconds += now_seconds() - start;
+
+    if (ret == 0)
+        codec->stats.frames_decoded++;
+    return ret;
+}
+
+int frame_codec_decode_yuv(struct frame_codec *codec, const unsigned char *data, size_t size, int w, int h, unsigned char *planes)
+{
+    if (!codec->ops->decode_yuv)
+        return -1;
+
+    double start = now_seconds();
+    int ret = codec->ops->decode_yuv(codec->state, data, size, w, h, planes);
+    codec->stats.decode_seconds += now_seconds() - start;
+
+    if (ret == 0)
+        codec->stats.frames_decoded++;
+    return ret;
+}
+
+int frame_codec_set_threads(struct frame_codec *codec, int threads)
+{
+    if (!codec->ops->set_threads)
+        return -1;
+    return codec->ops->set_threads(codec->state, threads);
+}
+
+int frame_codec_decode_scaled(struct frame_codec *codec, const unsigned char *data, size_t size, int w, int h, int scale, unsigned char *rgba)
+{
+    if (!codec->ops->decode_scaled)
+        return -1;
+
+    double start = now_seconds();
+    int ret = codec->ops->decode_scaled(codec->state, data, size, w, h, scale, rgba);
+    codec->stats.decode_seconds += now_seconds() - start;
+
+    if (ret == 0)
+        codec->stats.frames_decoded++;
+    return ret;
+}
+
+int frame_scaled_size(int size, int scale)
+{
+    return (size + scale - 1) / scale;
+}
+
+const struct codec_stats *frame_codec_stats(const struct frame_codec *codec)
+{
+    return &codec->stats;
+}
+
+void codec_stats_add(struct codec_stats *total, const struct codec_stats *stats)
+{
+    total->frames_encoded += stats->frames_encoded;
+    total->frames_decoded += stats->frames_decoded;
+    total->raw_bytes += stats->raw_bytes;
+    total->encoded_bytes += stats->encoded_bytes;
+    total->encode_seconds += stats->encode_seconds;
+    total->decode_seconds += stats->decode_seconds;
+}
+
+void codec_stats_print(const struct frame_codec_ops *ops, const struct codec_stats *stats)
+{
+    if (stats->frames_encoded > 0)
+    {
+        debprintf("%s: encoded %llu frames, %llu -> %llu bytes (%.1f%%), %.2f ms per frame\n", ops->name,
+                  (unsigned long long)stats->frames_encoded, (unsigned long long)stats->raw_bytes,
+                  (unsigned long long)stats->encoded_bytes, 100.0 * stats->encoded_bytes / stats->raw_bytes,
+                  1000.0 * stats->encode_seconds / stats->frames_encoded);
+    }
+    if (stats->frames_decoded > 0)
+    {
+        debprintf("%s: decoded %llu frames, %.2f ms per frame\n", ops->name,
+                  (unsigned long long)stats->frames_decoded, 1000.0 * stats->decode_seconds / stats->frames_decoded);
+    }
+}
+
+static void block_luma(const unsigned char *rgba, int w, int x0, int y0, double *luma)
+{
+    for (int y = 0; y < 8; y++)
+    {
+        const unsigned char *p = rgba + ((size_t)(y0 + y) * w + x0) * 4;
+        for (int x = 0; x < 8; x++, p += 4)
+            luma[y * 8 + x] = 0.299 * p[0] + 0.587 * p[1] + 0.114 * p[2];
+    }
+}
+
+double frame_ssim(const unsigned char *a, const unsigned char *b, int w, int h)
+{
+    const double c1 = (0.01 * 255) * (0.01 * 255);
+    const double c2 = (0.03 * 255) * (0.03 * 255);
+    double total = 0.0;
+    int blocks = 0;
+
+    for (int y0 = 0; y0 + 8 <= h; y0 += 8)
+    {
+        for (int x0 = 0; x0 + 8 <= w; x0 += 8)
+        {
+            double la[64], lb[64];
+            block_luma(a, w, x0, y0, la);
+            block_luma(b, w, x0, y0, lb);
+
+            double mean_a = 0, mean_b = 0;
+            for (int i = 0; i < 64; i++)
+            {
+                mean_a += la[i];
+                mean_b += lb[i];
+            }
+            mean_a /= 64;
+            mean_b /= 64;
+
+            double var_a = 0, var_b = 0, cov = 0;
+            for (int i = 0; i < 64; i++)
+            {
+                var_a += (la[i] - mean_a) * (la[i] - mean_a);
+                var_b += (lb[i] - mean_b) * (lb[i] - mean_b);
+                cov += (la[i] - mean_a) * (lb[i] - mean_b);
+            }
+            var_a /= 63;
+            var_b /= 63;
+            cov /= 63;
+
+            total += (2 * mean_a * mean_b + c1) * (2 * cov + c2) /
+                     ((mean_a * mean_a + mean_b * mean_b + c1) * (var_a + var_b + c2));
+            blocks++;
+        }
+    }
+    return blocks > 0 ? total / blocks : 1.0;
+}
+
+#define DELTA_MAGIC "VPD1"
+#define DELTA_HEADER_SIZE 8
+
+int delta_tiles_x(int w)
+{
+    return (w + DELTA_TILE_SIZE - 1) / DELTA_TILE_SIZE;
+}
+
+int delta_tile_count(int w, int h)
+{
+    return delta_tiles_x(w) * ((h + DELTA_TILE_SIZE - 1) / DELTA_TILE_SIZE);
+}
+
+size_t delta_frame_capacity(int w, int h)
+{
+    int max_tiles = delta_tile_count(w, h);
+    if (max_tiles > DELTA_MAX_TILES)
+        max_tiles = DELTA_MAX_TILES;
+
+    size_t frame = (size_t)w * h * 4;
+    size_t strip = (size_t)max_tiles * DELTA_TILE_BYTES;
+    return frame > strip ? frame : strip;
+}
+
+int delta_find_dirty_tiles(const unsigned char *prev, const unsigned char *cur, int w, int h, uint32_t *tiles)
+{
+    int tiles_x = delta_tiles_x(w);
+    int count = 0;
+
+    for (int ty = 0; ty * DELTA_TILE_SIZE < h; ty++)
+    {
+        int y0 = ty * DELTA_TILE_SIZE;
+        int th = h - y0 < DELTA_TILE_SIZE ? h - y0 : DELTA_TILE_SIZE;
+
+        for (int tx = 0; tx < tiles_x; tx++)
+        {
+            int x0 = tx * DELTA_TILE_SIZE;
+            int tw = w - x0 < DELTA_TILE_SIZE ? w - x0 : DELTA_TILE_SIZE;
+
+            for (int y = y0; y < y0 + th; y++)
+            {
+                size_t offset = ((size_t)y * w + x0) * 4;
+                if (memcmp(prev + offset, cur + offset, (size_t)tw * 4) != 0)
+                {
+                    tiles[count++] = ty * tiles_x + tx;
+                    break;
+                }
+            }
+        }
+    }
+    return count;
+}
+
+// Copies one tile into a full size strip slot, repeating the edge pixels of partial tiles
+static void pack_tile(const unsigned char *rgba, int w, int h, uint32_t tile, unsigned char *dst)
+{
+    int tiles_x = delta_tiles_x(w);
+    int x0 = (tile % tiles_x) * DELTA_TILE_SIZE;
+    int y0 = (tile / tiles_x) * DELTA_TILE_SIZE;
+    int tw = w - x0 < DELTA_TILE_SIZE ? w - x0 : DELTA_TILE_SIZE;
+
+    for (int y = 0; y < DELTA_TILE_SIZE; y++)
+    {
+        int src_y = y0 + y < h ? y0 + y : h - 1;
+        const unsigned char *src = rgba + ((size_t)src_y * w + x0) * 4;
+        unsigned char *row = dst + (size_t)y * DELTA_TILE_SIZE * 4;
+
+        memcpy(row, src, (size_t)tw * 4);
+        for (int x = tw; x < DELTA_TILE_SIZE; x++)
+            memcpy(row + x * 4, src + (tw - 1) * 4, 4);
+    }
+}
+
+const unsigned char *delta_encode(struct frame_codec *codec, const unsigned char *rgba, int w, int h, int quality,
+                                  const uint32_t *tiles, int tile_count, size_t *out_size)
+{
+    if (tile_count > DELTA_MAX_TILES)
+        return NULL;
+
+    int list_count = tile_count > 0 ? tile_count : 0;
+    size_t prefix = DELTA_HEADER_SIZE + (size_t)list_count * sizeof(uint32_t);
+
+    const unsigned char *payload = NULL;
+    size_t payload_size = 0;
+    if (tile_count < 0)
+    {
+        payload = frame_codec_encode(codec, rgba, w, h, quality, &payload_size);
+        if (!payload)
+            return NULL;
+    }
+    else if (tile_count > 0)
+    {
+        if (reserve(&codec->strip, &codec->strip_capacity, (size_t)tile_count * DELTA_TILE_BYTES) != 0)
+            return NULL;
+
+        for (int i = 0; i < tile_count; i++)
+            pack_tile(rgba, w, h, tiles[i], codec->strip + (size_t)i * DELTA_TILE_BYTES);
+
+        payload = frame_codec_encode(codec, codec->strip, DELTA_TILE_SIZE, tile_count * DELTA_TILE_SIZE, quality, &payload_size);
+        if (!payload)
+            return NULL;
+    }
+    // else nothing changed, the frame is just the header
+
+    if (reserve(&codec->delta, &codec->delta_capacity, prefix + payload_size) != 0)
+        return NULL;
+
+    uint32_t count = tile_count < 0 ? DELTA_KEYFRAME : (uint32_t)tile_count;
+    memcpy(codec->delta, DELTA_MAGIC, 4);
+    memcpy(codec->delta + 4, &count, sizeof(count));
+    if (list_count > 0)
+        memcpy(codec->delta + DELTA_HEADER_SIZE, tiles, (size_t)list_count * sizeof(uint32_t));
+    if (payload_size > 0)
+        memcpy(codec->delta + prefix, payload, payload_size);
+
+    *out_size = prefix + payload_size;
+    return codec->delta;
+}
+
+int delta_decode(struct frame_codec *codec, const unsigned char *data, size_t size, int w, int h,
+                 unsigned char *out, uint32_t *tiles, int *tile_count)
+{
+    uint32_t count;
+    if (size < DELTA_HEADER_SIZE || memcmp(data, DELTA_MAGIC, 4) != 0)
+        return -1;
+    memcpy(&count, data + 4, sizeof(count));
+
+    if (count == DELTA_KEYFRAME)
+    {
+        *tile_count = -1;
+        return frame_codec_decode(codec, data + DELTA_HEADER_SIZE, size - DELTA_HEADER_SIZE, w, h, out);
+    }
+
+    size_t prefix = DELTA_HEADER_SIZE + (size_t)count * sizeof(uint32_t);
+    if (count > DELTA_MAX_TILES || size < prefix)
+        return -1;
+
+    // Copied out since cached frames have no alignment guarantees
+    memcpy(tiles, data + DELTA_HEADER_SIZE, (size_t)count * sizeof(uint32_t));
+    uint32_t max_tile = delta_tile_count(w, h);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (tiles[i] >= max_tile)
+            return -1;
+    }
+
+    *tile_count = count;
+    if (count == 0)
+        return 0;
+    return frame_codec_decode(codec, data + prefix, size - prefix, DELTA_TILE_SIZE, count * DELTA_TILE_SIZE, out);
+}
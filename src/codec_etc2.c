@@ -0,0 +1,441 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "codec.h"
+
+void debprintf(const char *format, ...);
+
+// ETC2 RGB8, the compressed texture format every GLES3 implementation has to sample (Mesa's
+// software rasterizers included). Frames are stored as the bare 4x4 blocks, 8 bytes each, so
+// playback can hand them to glCompressedTexSubImage2D without touching a single pixel.
+// The encoder uses the ETC1 compatible individual and differential modes plus the ETC2 planar
+// mode, which suits the smooth gradients shaders tend to produce. The T and H modes are never
+// written. Alpha is dropped, cached frames are opaque.
+#define ETC2_GL_COMPRESSED_RGB8 0x9274 // GL_COMPRESSED_RGB8_ETC2
+#define ETC2_BLOCK_BYTES 8
+
+// Pixel index 0 and 1 add the small and large modifier, 2 and 3 subtract them
+static const int etc_modifiers[8][2] = {
+    {2, 8}, {5, 17}, {9, 29}, {13, 42}, {18, 60}, {24, 80}, {33, 106}, {47, 183},
+};
+
+struct etc2_codec
+{
+    unsigned char *buffer;
+    size_t capacity;
+};
+
+static inline int clamp255(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static inline int extend4(int c)
+{
+    return c << 4 | c;
+}
+
+static inline int extend5(int c)
+{
+    return c << 3 | c >> 2;
+}
+
+static inline int extend6(int c)
+{
+    return c << 2 | c >> 4;
+}
+
+static inline int extend7(int c)
+{
+    return c << 1 | c >> 6;
+}
+
+static inline int quantize(float v, int max)
+{
+    int q = (int)(v * max / 255.0f + 0.5f);
+    return q < 0 ? 0 : q > max ? max : q;
+}
+
+static size_t etc2_frame_size(int w, int h)
+{
+    return (size_t)((w + 3) / 4) * ((h + 3) / 4) * ETC2_BLOCK_BYTES;
+}
+
+static void write_block(unsigned char *out, uint64_t bits)
+{
+    for (int i = 0; i < 8; i++)
+        out[i] = bits >> (56 - i * 8);
+}
+
+static uint64_t read_block(const unsigned char *in)
+{
+    uint64_t bits = 0;
+    for (int i = 0; i < 8; i++)
+        bits = bits << 8 | in[i];
+    return bits;
+}
+
+// Pixels of a block are numbered column by column, as the index bits are
+static inline int pixel_in_half(int i, int flip)
+{
+    int x = i / 4, y = i % 4;
+    return flip ? y >= 2 : x >= 2;
+}
+
+// Picks the modifier table for one half of a block, filling in its pixel indices. Returns the squared error
+static int fit_half(const unsigned char block[16][3], int flip, int half, const int base[3], int *table, int indices[16])
+{
+    int best_error = -1;
+    int best_indices[16];
+
+    for (int t = 0; t < 8; t++)
+    {
+        int colors[4][3];
+        for (int m = 0; m < 4; m++)
+        {
+            int mod = m & 1 ? etc_modifiers[t][1] : etc_modifiers[t][0];
+            for (int c = 0; c < 3; c++)
+                colors[m][c] = clamp255(base[c] + (m & 2 ? -mod : mod));
+        }
+
+        int error = 0;
+        int chosen[16] = {0};
+        for (int i = 0; i < 16 && (best_error < 0 || error < best_error); i++)
+        {
+            if (pixel_in_half(i, flip) != half)
+                continue;
+
+            int best_pixel = -1;
+            for (int m = 0; m < 4; m++)
+            {
+                int e = 0;
+                for (int c = 0; c < 3; c++)
+                {
+                    int d = colors[m][c] - block[i][c];
+                    e += d * d;
+                }
+                if (best_pixel < 0 || e < best_pixel)
+                {
+                    best_pixel = e;
+                    chosen[i] = m;
+                }
+            }
+            error += best_pixel;
+        }
+
+        if (best_error < 0 || error < best_error)
+        {
+            best_error = error;
+            *table = t;
+            memcpy(best_indices, chosen, sizeof(chosen));
+        }
+    }
+
+    for (int i = 0; i < 16; i++)
+    {
+        if (pixel_in_half(i, flip) == half)
+            indices[i] = best_indices[i];
+    }
+    return best_error;
+}
+
+// Best individual or differential mode encoding, returns its squared error
+static int encode_etc1(const unsigned char block[16][3], uint64_t *out)
+{
+    int best_error = -1;
+
+    for (int flip = 0; flip < 2; flip++)
+    {
+        float avg[2][3] = {{0}};
+        for (int i = 0; i < 16; i++)
+        {
+            for (int c = 0; c < 3; c++)
+                avg[pixel_in_half(i, flip)][c] += block[i][c] / 8.0f;
+        }
+
+        // Differential stores the second color as a 3-bit offset from the first, which is finer when the halves are close
+        int q[2][3], base[2][3];
+        int diff = 1;
+        for (int c = 0; c < 3; c++)
+        {
+            q[0][c] = quantize(avg[0][c], 31);
+            q[1][c] = quantize(avg[1][c], 31);
+            int d = q[1][c] - q[0][c];
+            if (d < -4 || d > 3)
+                diff = 0;
+        }
+        for (int c = 0; c < 3; c++)
+        {
+            if (!diff)
+            {
+                q[0][c] = quantize(avg[0][c], 15);
+                q[1][c] = quantize(avg[1][c], 15);
+            }
+            base[0][c] = diff ? extend5(q[0][c]) : extend4(q[0][c]);
+            base[1][c] = diff ? extend5(q[1][c]) : extend4(q[1][c]);
+        }
+
+        int tables[2], indices[16];
+        int error = fit_half(block, flip, 0, base[0], &tables[0], indices);
+        if (best_error >= 0 && error >= best_error)
+            continue;
+        error += fit_half(block, flip, 1, base[1], &tables[1], indices);
+        if (best_error >= 0 && error >= best_error)
+            continue;
+
+        uint64_t bits = 0;
+        for (int c = 0; c < 3; c++)
+        {
+            int shift = 59 - c * 8;
+            if (diff)
+                bits |= (uint64_t)q[0][c] << shift | (uint64_t)((q[1][c] - q[0][c]) & 7) << (shift - 3);
+            else
+                bits |= (uint64_t)q[0][c] << (shift + 1) | (uint64_t)q[1][c] << (shift - 3);
+        }
+        bits |= (uint64_t)tables[0] << 37 | (uint64_t)tables[1] << 34 | (uint64_t)diff << 33 | (uint64_t)flip << 32;
+        for (int i = 0; i < 16; i++)
+            bits |= (uint64_t)(indices[i] >> 1) << (16 + i) | (uint64_t)(indices[i] & 1) << i;
+
+        best_error = error;
+        *out = bits;
+    }
+    return best_error;
+}
+
+static void planar_pixel(const int o[3], const int hc[3], const int v[3], int x, int y, int out[3])
+{
+    for (int c = 0; c < 3; c++)
+        out[c] = clamp255((x * (hc[c] - o[c]) + y * (v[c] - o[c]) + 4 * o[c] + 2) >> 2);
+}
+
+// A 5-bit base plus a signed 3-bit offset that is out of range, for picking the mode
+static inline int overflows(uint64_t bits, int shift)
+{
+    int base = (bits >> shift) & 31;
+    int d = (bits >> (shift - 3)) & 7;
+    if (d >= 4)
+        d -= 8;
+    return base + d < 0 || base + d > 31;
+}
+
+// Least squares plane through each channel, returns the squared error of the planar encoding
+static int encode_planar(const unsigned char block[16][3], uint64_t *out)
+{
+    int q[3][3]; // Origin, horizontal and vertical color, 6/7/6 bits per channel
+    int colors[3][3];
+    for (int c = 0; c < 3; c++)
+    {
+        float mean = 0, dx = 0, dy = 0;
+        for (int i = 0; i < 16; i++)
+            mean += block[i][c] / 16.0f;
+        for (int i = 0; i < 16; i++)
+        {
+            dx += (i / 4 - 1.5f) * (block[i][c] - mean);
+            dy += (i % 4 - 1.5f) * (block[i][c] - mean);
+        }
+        dx /= 20.0f; // Sum of (x - 1.5)^2 over the block
+        dy /= 20.0f;
+
+        // The decoder interpolates from the origin towards colors one block past the last pixel
+        float origin = mean - 1.5f * dx - 1.5f * dy;
+        int max = c == 1 ? 127 : 63;
+        q[0][c] = quantize(origin, max);
+        q[1][c] = quantize(origin + 4 * dx, max);
+        q[2][c] = quantize(origin + 4 * dy, max);
+        for (int k = 0; k < 3; k++)
+            colors[k][c] = c == 1 ? extend7(q[k][c]) : extend6(q[k][c]);
+    }
+
+    int error = 0;
+    for (int i = 0; i < 16; i++)
+    {
+        int px[3];
+        planar_pixel(colors[0], colors[1], colors[2], i / 4, i % 4, px);
+        for (int c = 0; c < 3; c++)
+            error += (px[c] - block[i][c]) * (px[c] - block[i][c]);
+    }
+
+    int ro = q[0][0], go = q[0][1], bo = q[0][2];
+    uint64_t bits = (uint64_t)ro << 57 | (uint64_t)(go >> 6) << 56 | (uint64_t)(go & 63) << 49 | (uint64_t)(bo >> 5) << 48 |
+                    (uint64_t)((bo >> 3) & 3) << 43 | (uint64_t)(bo & 7) << 39 | (uint64_t)(q[1][0] >> 1) << 34 | 1ULL << 33 |
+                    (uint64_t)(q[1][0] & 1) << 32 | (uint64_t)q[1][1] << 25 | (uint64_t)q[1][2] << 19 | (uint64_t)q[2][0] << 13 |
+                    (uint64_t)q[2][1] << 6 | (uint64_t)q[2][2];
+
+    // The unused bits 63, 55, 47-45 and 42 steer the decoder: red and green must stay in range
+    // (or it would read T or H mode), blue must overflow
+    if (overflows(bits, 59))
+        bits |= 1ULL << 63;
+    if (overflows(bits, 51))
+        bits |= 1ULL << 55;
+    if (!overflows(bits, 43))
+        bits |= 7ULL << 45;
+    if (!overflows(bits, 43))
+        bits = (bits & ~(7ULL << 45)) | 1ULL << 42;
+
+    *out = bits;
+    return error;
+}
+
+static void *etc2_create(void)
+{
+    return calloc(1, sizeof(struct etc2_codec));
+}
+
+static void etc2_destroy(void *state)
+{
+    struct etc2_codec *codec = state;
+    if (!codec)
+        return;
+    free(codec->buffer);
+    free(codec);
+}
+
+static const unsigned char *etc2_encode(void *state, const unsigned char *rgba, int w, int h, int quality, size_t *out_size)
+{
+    struct etc2_codec *codec = state;
+    (void)quality; // Blocks are always the same size
+
+    size_t size = etc2_frame_size(w, h);
+    if (size > codec->capacity)
+    {
+        unsigned char *buffer = realloc(codec->buffer, size);
+        if (!buffer)
+            return NULL;
+        codec->buffer = buffer;
+        codec->capacity = size;
+    }
+
+    unsigned char *out = codec->buffer;
+    for (int by = 0; by < h; by += 4)
+    {
+        for (int bx = 0; bx < w; bx += 4)
+        {
+            // Edge blocks repeat their last column/row
+            unsigned char block[16][3];
+            for (int i = 0; i < 16; i++)
+            {
+                int x = bx + i / 4 < w ? bx + i / 4 : w - 1;
+                int y = by + i % 4 < h ? by + i % 4 : h - 1;
+                memcpy(block[i], rgba + ((size_t)y * w + x) * 4, 3);
+            }
+
+            uint64_t etc1, planar;
+            int etc1_error = encode_etc1(block, &etc1);
+            int planar_error = encode_planar(block, &planar);
+            write_block(out, planar_error < etc1_error ? planar : etc1);
+            out += ETC2_BLOCK_BYTES;
+        }
+    }
+
+    *out_size = size;
+    return codec->buffer;
+}
+
+// Only decodes the modes the encoder writes, other blocks fail the frame
+static int decode_block(uint64_t bits, unsigned char block[16][3])
+{
+    if (bits >> 33 & 1 && overflows(bits, 43) && !overflows(bits, 59) && !overflows(bits, 51))
+    {
+        int o[3], hc[3], v[3];
+        int go = (int)(bits >> 56 & 1) << 6 | (int)(bits >> 49 & 63);
+        int bo = (int)(bits >> 48 & 1) << 5 | (int)(bits >> 43 & 3) << 3 | (int)(bits >> 39 & 7);
+        o[0] = extend6(bits >> 57 & 63);
+        o[1] = extend7(go);
+        o[2] = extend6(bo);
+        hc[0] = extend6((int)(bits >> 34 & 31) << 1 | (int)(bits >> 32 & 1));
+        hc[1] = extend7(bits >> 25 & 127);
+        hc[2] = extend6(bits >> 19 & 63);
+        v[0] = extend6(bits >> 13 & 63);
+        v[1] = extend7(bits >> 6 & 127);
+        v[2] = extend6(bits & 63);
+
+        for (int i = 0; i < 16; i++)
+        {
+            int px[3];
+            planar_pixel(o, hc, v, i / 4, i % 4, px);
+            for (int c = 0; c < 3; c++)
+                block[i][c] = px[c];
+        }
+        return 0;
+    }
+
+    int diff = bits >> 33 & 1;
+    int flip = bits >> 32 & 1;
+    int base[2][3];
+    for (int c = 0; c < 3; c++)
+    {
+        int shift = 59 - c * 8;
+        if (diff)
+        {
+            if (overflows(bits, shift))
+                return -1; // T, H or planar mode this encoder never writes
+            int q = bits >> shift & 31;
+            int d = bits >> (shift - 3) & 7;
+            base[0][c] = extend5(q);
+            base[1][c] = extend5(q + (d >= 4 ? d - 8 : d));
+        }
+        else
+        {
+            base[0][c] = extend4(bits >> (shift + 1) & 15);
+            base[1][c] = extend4(bits >> (shift - 3) & 15);
+        }
+    }
+
+    int tables[2] = {bits >> 37 & 7, bits >> 34 & 7};
+    for (int i = 0; i < 16; i++)
+    {
+        int half = pixel_in_half(i, flip);
+        int m = (int)(bits >> (16 + i) & 1) << 1 | (int)(bits >> i & 1);
+        int mod = etc_modifiers[tables[half]][m & 1];
+        if (m & 2)
+            mod = -mod;
+        for (int c = 0; c < 3; c++)
+            block[i][c] = clamp255(base[half][c] + mod);
+    }
+    return 0;
+}
+
+static int etc2_decode(void *state, const unsigned char *data, size_t size, int w, int h, unsigned char *rgba)
+{
+    (void)state; // Decoding needs no scratch memory
+
+    if (size != etc2_frame_size(w, h))
+    {
+        debprintf("ETC2 size mismatch: expected %zu bytes for %dx%d, got %zu\n", etc2_frame_size(w, h), w, h, size);
+        return -1;
+    }
+
+    for (int by = 0; by < h; by += 4)
+    {
+        for (int bx = 0; bx < w; bx += 4)
+        {
+            unsigned char block[16][3];
+            if (decode_block(read_block(data), block) != 0)
+                return -1;
+            data += ETC2_BLOCK_BYTES;
+
+            for (int i = 0; i < 16; i++)
+            {
+                int x = bx + i / 4, y = by + i % 4;
+                if (x >= w || y >= h)
+                    continue;
+                unsigned char *px = rgba + ((size_t)y * w + x) * 4;
+                memcpy(px, block[i], 3);
+                px[3] = 255;
+            }
+        }
+    }
+    return 0;
+}
+
+const struct frame_codec_ops etc2_frame_codec = {
+    .id = 4,
+    .name = "etc2",
+    .lossy = 1,
+    .has_quality = 0, // The block size is fixed, so --cache-quality has nothing to trade
+    .gl_format = ETC2_GL_COMPRESSED_RGB8,
+    .create = etc2_create,
+    .destroy = etc2_destroy,
+    .encode = etc2_encode,
+    .decode = etc2_decode,
+};
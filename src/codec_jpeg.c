@@ -0,0 +1,792 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <jpeglib.h>
+#include <jerror.h>
+#include <setjmp.h>
+
+#include "codec.h"
+
+void debprintf(const char *format, ...);
+
+// JPEG error handling
+struct jpeg_error_mgr_jmp
+{
+    struct jpeg_error_mgr pub;
+    jmp_buf setjmp_buffer;
+};
+typedef struct jpeg_error_mgr_jmp *jpeg_error_mgr_jmp_ptr;
+
+static void jpeg_error_exit_jmp(j_common_ptr cinfo)
+{
+    jpeg_error_mgr_jmp_ptr myerr = (jpeg_error_mgr_jmp_ptr)cinfo->err;
+    longjmp(myerr->setjmp_buffer, 1);
+}
+
+// Destination manager writing into the codec's scratch buffer, grown only when a frame doesn't fit
+struct scratch_dest
+{
+    struct jpeg_destination_mgr pub;
+    unsigned char *buffer;
+    size_t capacity;
+    size_t size; // Bytes written by the last finished frame
+};
+
+// = Restart index =
+// Frames at least RESTART_MIN_HEIGHT rows tall are encoded with a restart marker after every MCU row,
+// which resets the entropy decoder, so any run of rows between two markers can be decoded on its own. The offsets of those intervals
+// follow the EOI, where other JPEG decoders never look:
+// uint32 interval offsets[count], uint32 SOF height field offset, uint32 rows per interval, uint32 count, "VPRS"
+#define RESTART_INDEX_MAGIC "VPRS"
+
+// Smaller frames decode fast enough on one thread, and the markers and index cost them relatively
+// more (about 0.5% of a 1080p frame, 1.7% at 480x270)
+#define RESTART_MIN_HEIGHT 1080
+
+struct restart_index
+{
+    const unsigned char *offsets; // First entropy coded byte of each interval, unaligned uint32s
+    uint32_t count;
+    uint32_t sof_height; // Where the frame height is stored in the SOF segment
+    uint32_t rows;       // Pixel rows per interval
+    size_t header_size;  // Everything before the first interval
+    size_t jpeg_size;    // Up to and including the EOI marker
+};
+
+// One decoder of a slice pool, every thread needs its own libjpeg state
+struct slice_decoder
+{
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_error_mgr_jmp derr;
+    int created;
+
+    JSAMPROW *rows;
+    int row_capacity;
+
+    // The slice rebuilt into a standalone JPEG
+    unsigned char *stream;
+    size_t stream_capacity;
+
+    struct slice_pool *pool;
+    int slice; // Which slice of every frame this decoder takes
+    pthread_t thread;
+    int thread_started;
+    int result;
+};
+
+// Decoders for the slices of one frame, decoders[0] runs on the calling thread
+struct slice_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t start; // Signalled with a new generation to decode
+    pthread_cond_t done;  // Signalled when the last slice finished
+    int generation;
+    int pending;
+    int stopping;
+
+    // The frame being decoded
+    const unsigned char *data;
+    const struct restart_index *index;
+    int w, h;
+    unsigned char *rgba;
+    int slice_count;
+
+    int count;
+    struct slice_decoder decoders[];
+};
+
+struct jpeg_codec
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr_jmp cerr;
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_error_mgr_jmp derr;
+
+    struct scratch_dest dest;
+    int quality; // Quality the compressor tables were last set up for, 0 if never
+
+    // Row pointers into the frame being encoded/decoded
+    JSAMPROW *rows;
+    int row_capacity;
+
+    struct slice_pool *slices; // NULL unless frames are decoded on several threads
+};
+
+static void scratch_init_destination(j_compress_ptr cinfo)
+{
+    struct scratch_dest *dest = (struct scratch_dest *)cinfo->dest;
+    dest->pub.next_output_byte = dest->buffer;
+    dest->pub.free_in_buffer = dest->capacity;
+}
+
+static boolean scratch_empty_output_buffer(j_compress_ptr cinfo)
+{
+    struct scratch_dest *dest = (struct scratch_dest *)cinfo->dest;
+
+    // libjpeg only calls this when the whole buffer is full
+    size_t new_capacity = dest->capacity * 2;
+    unsigned char *buffer = realloc(dest->buffer, new_capacity);
+    if (!buffer)
+        ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 10);
+
+    dest->pub.next_output_byte = buffer + dest->capacity;
+    dest->pub.free_in_buffer = new_capacity - dest->capacity;
+    dest->buffer = buffer;
+    dest->capacity = new_capacity;
+    return TRUE;
+}
+
+static void scratch_term_destination(j_compress_ptr cinfo)
+{
+    struct scratch_dest *dest = (struct scratch_dest *)cinfo->dest;
+    dest->size = dest->capacity - dest->pub.free_in_buffer;
+}
+
+static int reserve_row_pointers(JSAMPROW **rows, int *capacity, int h)
+{
+    if (h <= *capacity)
+        return 0;
+
+    JSAMPROW *grown = realloc(*rows, (size_t)h * sizeof(JSAMPROW));
+    if (!grown)
+        return -1;
+    *rows = grown;
+    *capacity = h;
+    return 0;
+}
+
+static int reserve_rows(struct jpeg_codec *codec, int h)
+{
+    return reserve_row_pointers(&codec->rows, &codec->row_capacity, h);
+}
+
+struct jpeg_codec *jpeg_codec_create(void)
+{
+    struct jpeg_codec *codec = calloc(1, sizeof(struct jpeg_codec));
+    if (!codec)
+        return NULL;
+
+    codec->cinfo.err = jpeg_std_error(&codec->cerr.pub);
+    codec->cerr.pub.error_exit = jpeg_error_exit_jmp;
+    codec->dinfo.err = jpeg_std_error(&codec->derr.pub);
+    codec->derr.pub.error_exit = jpeg_error_exit_jmp;
+
+    // Creating the objects only allocates memory, that can still fail
+    if (setjmp(codec->cerr.setjmp_buffer))
+    {
+        free(codec);
+        return NULL;
+    }
+    jpeg_create_compress(&codec->cinfo);
+
+    if (setjmp(codec->derr.setjmp_buffer))
+    {
+        jpeg_destroy_compress(&codec->cinfo);
+        free(codec);
+        return NULL;
+    }
+    jpeg_create_decompress(&codec->dinfo);
+
+    codec->dest.pub.init_destination = scratch_init_destination;
+    codec->dest.pub.empty_output_buffer = scratch_empty_output_buffer;
+    codec->dest.pub.term_destination = scratch_term_destination;
+    codec->cinfo.dest = &codec->dest.pub;
+
+    // Input is always RGBA straight from glReadPixels
+    codec->cinfo.in_color_space = JCS_EXT_RGBA;
+    codec->cinfo.input_components = 4;
+
+    return codec;
+}
+
+static void slice_pool_destroy(struct slice_pool *pool);
+
+void jpeg_codec_destroy(struct jpeg_codec *codec)
+{
+    if (!codec)
+        return;
+
+    slice_pool_destroy(codec->slices);
+    jpeg_destroy_compress(&codec->cinfo);
+    jpeg_destroy_decompress(&codec->dinfo);
+    free(codec->dest.buffer);
+    free(codec->rows);
+    free(codec);
+}
+
+static int reserve_dest(struct jpeg_codec *codec, size_t capacity)
+{
+    if (capacity <= codec->dest.capacity)
+        return 0;
+
+    unsigned char *buffer = realloc(codec->dest.buffer, capacity);
+    if (!buffer)
+        return -1;
+    codec->dest.buffer = buffer;
+    codec->dest.capacity = capacity;
+    return 0;
+}
+
+static void write_u32(unsigned char *p, uint32_t v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+static uint32_t read_u32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Offset of the first entropy coded byte, and of the SOF height field in *sof_height. Returns 0 if there is no baseline SOF
+static size_t find_scan_start(const unsigned char *data, size_t size, uint32_t *sof_height)
+{
+    *sof_height = 0;
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+        return 0;
+
+    size_t p = 2;
+    while (p + 4 <= size && data[p] == 0xFF)
+    {
+        int marker = data[p + 1];
+        size_t length = (size_t)data[p + 2] << 8 | data[p + 3];
+        if (marker == 0xC0 || marker == 0xC1)
+            *sof_height = p + 5; // FF Cn, length, precision, then the height
+        p += 2 + length;
+        if (marker == 0xDA)
+            return *sof_height ? p : 0;
+    }
+    return 0;
+}
+
+// Appends the restart index of the frame that was just compressed, a frame without one still decodes on one thread
+static void append_restart_index(struct jpeg_codec *codec, int h)
+{
+    const unsigned char *data = codec->dest.buffer;
+    size_t size = codec->dest.size;
+    uint32_t rows = codec->cinfo.max_v_samp_factor * DCTSIZE * codec->cinfo.restart_in_rows;
+    uint32_t count = (h + rows - 1) / rows;
+    uint32_t sof_height;
+
+    size_t start = find_scan_start(data, size, &sof_height);
+    if (!start || size < 2 || data[size - 2] != 0xFF || data[size - 1] != 0xD9)
+        return;
+
+    size_t index_size = (size_t)count * 4 + 16;
+    if (reserve_dest(codec, size + index_size) != 0)
+        return;
+    data = codec->dest.buffer;
+    unsigned char *out = codec->dest.buffer + size;
+
+    // Stuffed FF 00 pairs keep FF Dx unique to restart markers inside the scan
+    uint32_t found = 0;
+    write_u32(out, start);
+    found++;
+    for (size_t p = start; p + 2 < size; p++)
+    {
+        if (data[p] == 0xFF && (data[p + 1] & 0xF8) == 0xD0)
+        {
+            if (found == count)
+                return;
+            write_u32(out + found * 4, p + 2);
+            found++;
+            p++;
+        }
+    }
+    if (found != count)
+        return;
+
+    write_u32(out + count * 4, sof_height);
+    write_u32(out + count * 4 + 4, rows);
+    write_u32(out + count * 4 + 8, count);
+    memcpy(out + count * 4 + 12, RESTART_INDEX_MAGIC, 4);
+    codec->dest.size = size + index_size;
+}
+
+// Returns 0 if the frame carries a usable restart index for a frame h rows tall
+static int read_restart_index(const unsigned char *data, size_t size, int h, struct restart_index *index)
+{
+    if (size < 16 || memcmp(data + size - 4, RESTART_INDEX_MAGIC, 4) != 0)
+        return -1;
+
+    index->count = read_u32(data + size - 8);
+    index->rows = read_u32(data + size - 12);
+    index->sof_height = read_u32(data + size - 16);
+    if (index->count < 1 || index->rows < 1 || index->count > (size - 16) / 4 ||
+        index->count != (uint32_t)((h + index->rows - 1) / index->rows))
+        return -1;
+
+    index->jpeg_size = size - 16 - (size_t)index->count * 4;
+    index->offsets = data + index->jpeg_size;
+    index->header_size = read_u32(index->offsets);
+    if (index->jpeg_size < 4 || data[index->jpeg_size - 2] != 0xFF || data[index->jpeg_size - 1] != 0xD9 ||
+        index->sof_height + 2 > index->header_size || index->header_size > index->jpeg_size - 2)
+        return -1;
+
+    // Every later interval has to start right after a restart marker
+    size_t prev = index->header_size;
+    for (uint32_t i = 1; i < index->count; i++)
+    {
+        size_t offset = read_u32(index->offsets + i * 4);
+        if (offset < prev + 2 || offset > index->jpeg_size - 2 || data[offset - 2] != 0xFF || (data[offset - 1] & 0xF8) != 0xD0)
+            return -1;
+        prev = offset;
+    }
+    return 0;
+}
+
+// Decodes intervals [first, last) of the pool's frame into their rows of the RGBA buffer
+static int decode_slice(struct slice_pool *pool, struct slice_decoder *decoder, uint32_t first, uint32_t last)
+{
+    const unsigned char *data = pool->data;
+    const struct restart_index *index = pool->index;
+    int y0 = first * index->rows;
+    int rows = (int)(last * index->rows) < pool->h ? (int)((last - first) * index->rows) : pool->h - y0;
+
+    // Same headers with the slice's height, its intervals with their markers renumbered from RST0, EOI
+    size_t end = last < index->count ? read_u32(index->offsets + last * 4) : index->jpeg_size;
+    size_t start = read_u32(index->offsets + first * 4);
+    size_t stream_size = index->header_size + (end - start) + 2;
+    if (stream_size > decoder->stream_capacity)
+    {
+        unsigned char *stream = realloc(decoder->stream, stream_size);
+        if (!stream)
+            return -1;
+        decoder->stream = stream;
+        decoder->stream_capacity = stream_size;
+    }
+    memcpy(decoder->stream, data, index->header_size);
+    decoder->stream[index->sof_height] = rows >> 8;
+    decoder->stream[index->sof_height + 1] = rows;
+
+    unsigned char *out = decoder->stream + index->header_size;
+    for (uint32_t i = first; i < last; i++)
+    {
+        size_t from = read_u32(index->offsets + i * 4);
+        size_t to = i + 1 < index->count ? read_u32(index->offsets + (i + 1) * 4) - 2 : index->jpeg_size - 2;
+        memcpy(out, data + from, to - from);
+        out += to - from;
+        if (i + 1 < last)
+        {
+            *out++ = 0xFF;
+            *out++ = 0xD0 + ((i - first) & 7);
+        }
+    }
+    *out++ = 0xFF;
+    *out++ = 0xD9;
+
+    if (reserve_row_pointers(&decoder->rows, &decoder->row_capacity, rows) != 0)
+        return -1;
+
+    j_decompress_ptr dinfo = &decoder->dinfo;
+    if (setjmp(decoder->derr.setjmp_buffer))
+    {
+        jpeg_abort_decompress(dinfo);
+        return -1;
+    }
+
+    jpeg_mem_src(dinfo, decoder->stream, out - decoder->stream);
+    (void)jpeg_read_header(dinfo, TRUE);
+    dinfo->out_color_space = JCS_EXT_RGBA;
+
+    // Fancy upsampling blends chroma with the rows of the neighbouring intervals, which a slice doesn't
+    // have, so it would leave seams. Plain upsampling gives the same pixels whichever slice a row is in
+    dinfo->do_fancy_upsampling = FALSE;
+    (void)jpeg_start_decompress(dinfo);
+    if (dinfo->output_width != (unsigned int)pool->w || dinfo->output_height != (unsigned int)rows)
+    {
+        jpeg_abort_decompress(dinfo);
+        return -1;
+    }
+
+    for (int y = 0; y < rows; y++)
+        decoder->rows[y] = pool->rgba + (size_t)(y0 + y) * pool->w * 4;
+    while (dinfo->output_scanline < dinfo->output_height)
+    {
+        if (jpeg_read_scanlines(dinfo, decoder->rows + dinfo->output_scanline, dinfo->output_height - dinfo->output_scanline) == 0)
+        {
+            jpeg_abort_decompress(dinfo);
+            return -1;
+        }
+    }
+    jpeg_finish_decompress(dinfo);
+    return 0;
+}
+
+// Slice k of slice_count gets an even share of the intervals
+static int decode_pool_slice(struct slice_pool *pool, int k)
+{
+    uint32_t count = pool->index->count;
+    uint32_t first = (uint64_t)count * k / pool->slice_count;
+    uint32_t last = (uint64_t)count * (k + 1) / pool->slice_count;
+    return first < last ? decode_slice(pool, &pool->decoders[k], first, last) : 0;
+}
+
+static void *slice_worker(void *arg)
+{
+    struct slice_decoder *decoder = arg;
+    struct slice_pool *pool = decoder->pool;
+    int generation = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
+    {
+        while (pool->generation == generation && !pool->stopping)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->stopping)
+            break;
+        generation = pool->generation;
+
+        // Decoders beyond this frame's slice count just skip it
+        int active = decoder->slice < pool->slice_count;
+        pthread_mutex_unlock(&pool->lock);
+        if (active)
+            decoder->result = decode_pool_slice(pool, decoder->slice);
+        pthread_mutex_lock(&pool->lock);
+
+        if (active && --pool->pending == 0)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void slice_pool_destroy(struct slice_pool *pool)
+{
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->count; i++)
+    {
+        struct slice_decoder *decoder = &pool->decoders[i];
+        if (decoder->thread_started)
+            pthread_join(decoder->thread, NULL);
+        if (decoder->created)
+            jpeg_destroy_decompress(&decoder->dinfo);
+        free(decoder->rows);
+        free(decoder->stream);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    free(pool);
+}
+
+static struct slice_pool *slice_pool_create(int threads)
+{
+    struct slice_pool *pool = calloc(1, sizeof(struct slice_pool) + (size_t)threads * sizeof(struct slice_decoder));
+    if (!pool)
+        return NULL;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->count = threads;
+
+    for (int i = 0; i < threads; i++)
+    {
+        struct slice_decoder *decoder = &pool->decoders[i];
+        decoder->pool = pool;
+        decoder->slice = i;
+        decoder->dinfo.err = jpeg_std_error(&decoder->derr.pub);
+        decoder->derr.pub.error_exit = jpeg_error_exit_jmp;
+        if (setjmp(decoder->derr.setjmp_buffer))
+        {
+            slice_pool_destroy(pool);
+            return NULL;
+        }
+        jpeg_create_decompress(&decoder->dinfo);
+        decoder->created = 1;
+
+        // The calling thread decodes the first slice itself
+        if (i > 0)
+        {
+            if (pthread_create(&decoder->thread, NULL, slice_worker, decoder) != 0)
+            {
+                perror("pthread_create");
+                slice_pool_destroy(pool);
+                return NULL;
+            }
+            decoder->thread_started = 1;
+        }
+    }
+    return pool;
+}
+
+static int decode_slices(struct slice_pool *pool, const unsigned char *data, const struct restart_index *index, int w, int h,
+                         unsigned char *rgba)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->data = data;
+    pool->index = index;
+    pool->w = w;
+    pool->h = h;
+    pool->rgba = rgba;
+    pool->slice_count = (uint32_t)pool->count < index->count ? pool->count : (int)index->count;
+    pool->pending = pool->slice_count - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    int result = decode_pool_slice(pool, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 1; i < pool->slice_count; i++)
+    {
+        if (pool->decoders[i].result != 0)
+            result = -1;
+    }
+    return result;
+}
+
+int jpeg_codec_set_threads(struct jpeg_codec *codec, int threads)
+{
+    slice_pool_destroy(codec->slices);
+    codec->slices = NULL;
+    if (threads <= 1)
+        return 0;
+
+    codec->slices = slice_pool_create(threads);
+    return codec->slices ? 0 : -1;
+}
+
+// Compress RGBA into JPEG in memory
+const unsigned char *jpeg_codec_encode(struct jpeg_codec *codec, const unsigned char *rgba, int w, int h, int quality, size_t *out_size)
+{
+    j_compress_ptr cinfo = &codec->cinfo;
+
+    if (reserve_rows(codec, h) != 0)
+        return NULL;
+
+    // A good first guess for most frames, grown on demand after that
+    if (reserve_dest(codec, (size_t)w * h / 2 + 4096) != 0)
+        return NULL;
+
+    if (setjmp(codec->cerr.setjmp_buffer))
+    {
+        jpeg_abort_compress(cinfo); // Keeps the object usable for the next frame
+        return NULL;
+    }
+
+    if (codec->quality != quality)
+    {
+        jpeg_set_defaults(cinfo);
+        jpeg_set_quality(cinfo, quality, TRUE);
+        codec->quality = quality;
+    }
+    cinfo->image_width = w;
+    cinfo->image_height = h;
+    cinfo->restart_in_rows = h >= RESTART_MIN_HEIGHT ? 1 : 0; // Set every frame, jpeg_set_defaults clears it
+
+    for (int y = 0; y < h; y++)
+        codec->rows[y] = (JSAMPROW)(rgba + (size_t)y * w * 4);
+
+    jpeg_start_compress(cinfo, TRUE);
+    while (cinfo->next_scanline < cinfo->image_height)
+    {
+        jpeg_write_scanlines(cinfo, codec->rows + cinfo->next_scanline, cinfo->image_height - cinfo->next_scanline);
+    }
+    jpeg_finish_compress(cinfo);
+    if (cinfo->restart_in_rows)
+        append_restart_index(codec, h);
+
+    *out_size = codec->dest.size;
+    return codec->dest.buffer;
+}
+
+// Decompress JPEG into RGBA
+int jpeg_codec_decode(struct jpeg_codec *codec, const unsigned char *jpeg_data, size_t jpeg_size, int w, int h, unsigned char *rgba)
+{
+    struct restart_index index;
+    if (codec->slices && read_restart_index(jpeg_data, jpeg_size, h, &index) == 0)
+        return decode_slices(codec->slices, jpeg_data, &index, w, h, rgba);
+
+    return jpeg_codec_decode_scaled(codec, jpeg_data, jpeg_size, w, h, 1, rgba);
+}
+
+int jpeg_codec_decode_scaled(struct jpeg_codec *codec, const unsigned char *jpeg_data, size_t jpeg_size, int w, int h, int scale,
+                             unsigned char *rgba)
+{
+    j_decompress_ptr dinfo = &codec->dinfo;
+
+    // libjpeg rounds scaled sizes up, the same way frame_scaled_size does
+    w = frame_scaled_size(w, scale);
+    h = frame_scaled_size(h, scale);
+
+    if (reserve_rows(codec, h) != 0)
+        return -1;
+
+    if (setjmp(codec->derr.setjmp_buffer))
+    {
+        jpeg_abort_decompress(dinfo);
+        return -1; // Error - jump out
+    }
+
+    jpeg_mem_src(dinfo, jpeg_data, jpeg_size);
+    (void)jpeg_read_header(dinfo, TRUE); // Cast to void to ignore the warnings
+
+    // libjpeg-turbo fills the alpha byte with 255 itself
+    dinfo->out_color_space = JCS_EXT_RGBA;
+    dinfo->scale_num = 1; // Reset by every jpeg_read_header
+    dinfo->scale_denom = scale;
+    // A codec that decodes in slices has to use the plain upsampling of decode_slice everywhere, or its
+    // frames would change look between the two paths. Without slices libjpeg's smoother default stays
+    dinfo->do_fancy_upsampling = codec->slices ? FALSE : TRUE;
+    (void)jpeg_start_decompress(dinfo);
+
+    if (dinfo->output_width != (unsigned int)w || dinfo->output_height != (unsigned int)h)
+    {
+        debprintf("JPEG size mismatch: expected %dx%d, got %dx%d\n", w, h, dinfo->output_width, dinfo->output_height);
+        jpeg_abort_decompress(dinfo);
+        return -1;
+    }
+
+    for (int y = 0; y < h; y++)
+        codec->rows[y] = rgba + (size_t)y * w * 4;
+
+    while (dinfo->output_scanline < dinfo->output_height)
+    {
+        if (jpeg_read_scanlines(dinfo, codec->rows + dinfo->output_scanline, dinfo->output_height - dinfo->output_scanline) == 0)
+        {
+            debprintf("Failed to read scanline %d\n", dinfo->output_scanline);
+            jpeg_abort_decompress(dinfo);
+            return -1;
+        }
+    }
+
+    jpeg_finish_decompress(dinfo);
+    return 0;
+}
+
+void jpeg_yuv_layout(int w, int h, struct yuv_layout *layout)
+{
+    layout->y_stride = (w + 15) & ~15;
+    layout->y_rows = (h + 15) & ~15;
+    layout->c_stride = layout->y_stride / 2;
+    layout->c_rows = layout->y_rows / 2;
+    layout->y_size = (size_t)layout->y_stride * layout->y_rows;
+    layout->c_size = (size_t)layout->c_stride * layout->c_rows;
+    layout->total_size = layout->y_size + 2 * layout->c_size;
+}
+
+// Decompress JPEG into Y/Cb/Cr planes
+int jpeg_codec_decode_yuv(struct jpeg_codec *codec, const unsigned char *jpeg_data, size_t jpeg_size, int w, int h, unsigned char *planes)
+{
+    j_decompress_ptr dinfo = &codec->dinfo;
+    struct yuv_layout layout;
+    jpeg_yuv_layout(w, h, &layout);
+
+    if (setjmp(codec->derr.setjmp_buffer))
+    {
+        jpeg_abort_decompress(dinfo);
+        return -1;
+    }
+
+    jpeg_mem_src(dinfo, jpeg_data, jpeg_size);
+    (void)jpeg_read_header(dinfo, TRUE); // Resets raw_data_out, so set it every frame
+
+    if (dinfo->image_width != (unsigned int)w || dinfo->image_height != (unsigned int)h ||
+        dinfo->num_components != 3 || dinfo->jpeg_color_space != JCS_YCbCr ||
+        dinfo->comp_info[0].h_samp_factor != 2 || dinfo->comp_info[0].v_samp_factor != 2 ||
+        dinfo->comp_info[1].h_samp_factor != 1 || dinfo->comp_info[1].v_samp_factor != 1 ||
+        dinfo->comp_info[2].h_samp_factor != 1 || dinfo->comp_info[2].v_samp_factor != 1)
+    {
+        debprintf("JPEG is not %dx%d YUV 4:2:0, can't decode it to planes\n", w, h);
+        jpeg_abort_decompress(dinfo);
+        return -1;
+    }
+
+    dinfo->raw_data_out = TRUE;
+    (void)jpeg_start_decompress(dinfo);
+
+    unsigned char *y_plane = planes;
+    unsigned char *cb_plane = planes + layout.y_size;
+    unsigned char *cr_plane = cb_plane + layout.c_size;
+
+    // One iMCU row is 16 luma and 8 chroma rows
+    JSAMPROW y_rows[16], cb_rows[8], cr_rows[8];
+    JSAMPARRAY plane_rows[3] = {y_rows, cb_rows, cr_rows};
+
+    while (dinfo->output_scanline < dinfo->output_height)
+    {
+        int line = dinfo->output_scanline;
+        for (int i = 0; i < 16; i++)
+            y_rows[i] = y_plane + (size_t)(line + i) * layout.y_stride;
+        for (int i = 0; i < 8; i++)
+        {
+            cb_rows[i] = cb_plane + (size_t)(line / 2 + i) * layout.c_stride;
+            cr_rows[i] = cr_plane + (size_t)(line / 2 + i) * layout.c_stride;
+        }
+
+        if (jpeg_read_raw_data(dinfo, plane_rows, 16) == 0)
+        {
+            debprintf("Failed to read raw data at line %d\n", line);
+            jpeg_abort_decompress(dinfo);
+            return -1;
+        }
+    }
+
+    jpeg_finish_decompress(dinfo);
+    return 0;
+}
+
+static void *jpeg_state_create(void)
+{
+    return jpeg_codec_create();
+}
+
+static void jpeg_state_destroy(void *state)
+{
+    jpeg_codec_destroy(state);
+}
+
+static const unsigned char *jpeg_state_encode(void *state, const unsigned char *rgba, int w, int h, int quality, size_t *out_size)
+{
+    return jpeg_codec_encode(state, rgba, w, h, quality, out_size);
+}
+
+static int jpeg_state_decode(void *state, const unsigned char *data, size_t size, int w, int h, unsigned char *rgba)
+{
+    return jpeg_codec_decode(state, data, size, w, h, rgba);
+}
+
+static int jpeg_state_decode_scaled(void *state, const unsigned char *data, size_t size, int w, int h, int scale, unsigned char *rgba)
+{
+    return jpeg_codec_decode_scaled(state, data, size, w, h, scale, rgba);
+}
+
+static int jpeg_state_set_threads(void *state, int threads)
+{
+    return jpeg_codec_set_threads(state, threads);
+}
+
+static int jpeg_state_decode_yuv(void *state, const unsigned char *data, size_t size, int w, int h, unsigned char *planes)
+{
+    return jpeg_codec_decode_yuv(state, data, size, w, h, planes);
+}
+
+const struct frame_codec_ops jpeg_frame_codec = {
+    .id = 1,
+    .name = "jpeg",
+    .lossy = 1,
+    .has_quality = 1,
+    .create = jpeg_state_create,
+    .destroy = jpeg_state_destroy,
+    .encode = jpeg_state_encode,
+    .decode = jpeg_state_decode,
+    .decode_yuv = jpeg_state_decode_yuv,
+    .decode_scaled = jpeg_state_decode_scaled,
+    .set_threads = jpeg_state_set_threads,
+};
@@ -0,0 +1,254 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "codec.h"
+
+void debprintf(const char *format, ...);
+
+// "Quite OK Image" format (https://qoiformat.org), lossless and byte oriented. Flat colours and
+// smooth gradients collapse into runs and small diffs, and decoding is a single pass over the data
+// without any transform, which is much cheaper than JPEG for that kind of shader.
+#define QOI_OP_INDEX 0x00 // 00xxxxxx
+#define QOI_OP_DIFF 0x40  // 01xxxxxx
+#define QOI_OP_LUMA 0x80  // 10xxxxxx
+#define QOI_OP_RUN 0xc0   // 11xxxxxx
+#define QOI_OP_RGB 0xfe
+#define QOI_OP_RGBA 0xff
+#define QOI_MASK_2 0xc0
+
+#define QOI_HEADER_SIZE 14
+#define QOI_PADDING_SIZE 8
+#define QOI_MAX_RUN 62
+
+static const unsigned char qoi_padding[QOI_PADDING_SIZE] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+struct qoi_codec
+{
+    unsigned char *buffer;
+    size_t capacity;
+};
+
+static inline int qoi_hash(const unsigned char *px)
+{
+    return (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+}
+
+static void write_u32_be(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t read_u32_be(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void *qoi_create(void)
+{
+    return calloc(1, sizeof(struct qoi_codec));
+}
+
+static void qoi_destroy(void *state)
+{
+    struct qoi_codec *codec = state;
+    if (!codec)
+        return;
+    free(codec->buffer);
+    free(codec);
+}
+
+static const unsigned char *qoi_encode(void *state, const unsigned char *rgba, int w, int h, int quality, size_t *out_size)
+{
+    struct qoi_codec *codec = state;
+    (void)quality; // Lossless
+
+    // Worst case is every pixel as QOI_OP_RGBA
+    size_t pixels = (size_t)w * h;
+    size_t max_size = QOI_HEADER_SIZE + pixels * 5 + QOI_PADDING_SIZE;
+    if (max_size > codec->capacity)
+    {
+        unsigned char *buffer = realloc(codec->buffer, max_size);
+        if (!buffer)
+            return NULL;
+        codec->buffer = buffer;
+        codec->capacity = max_size;
+    }
+
+    unsigned char *out = codec->buffer;
+    memcpy(out, "qoif", 4);
+    write_u32_be(out + 4, w);
+    write_u32_be(out + 8, h);
+    out[12] = 4; // Channels
+    out[13] = 0; // sRGB with linear alpha
+    size_t p = QOI_HEADER_SIZE;
+
+    unsigned char index[64][4];
+    memset(index, 0, sizeof(index));
+    unsigned char prev[4] = {0, 0, 0, 255};
+    int run = 0;
+
+    for (size_t i = 0; i < pixels; i++)
+    {
+        const unsigned char *px = rgba + i * 4;
+
+        if (memcmp(px, prev, 4) == 0)
+        {
+            if (++run == QOI_MAX_RUN)
+            {
+                out[p++] = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+            continue;
+        }
+
+        if (run > 0)
+        {
+            out[p++] = QOI_OP_RUN | (run - 1);
+            run = 0;
+        }
+
+        int hash = qoi_hash(px);
+        if (memcmp(index[hash], px, 4) == 0)
+        {
+            out[p++] = QOI_OP_INDEX | hash;
+        }
+        else
+        {
+            memcpy(index[hash], px, 4);
+
+            if (px[3] == prev[3])
+            {
+                signed char vr = px[0] - prev[0];
+                signed char vg = px[1] - prev[1];
+                signed char vb = px[2] - prev[2];
+                signed char vg_r = vr - vg;
+                signed char vg_b = vb - vg;
+
+                if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2)
+                {
+                    out[p++] = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+                }
+                else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8)
+                {
+                    out[p++] = QOI_OP_LUMA | (vg + 32);
+                    out[p++] = (vg_r + 8) << 4 | (vg_b + 8);
+                }
+                else
+                {
+                    out[p++] = QOI_OP_RGB;
+                    out[p++] = px[0];
+                    out[p++] = px[1];
+                    out[p++] = px[2];
+                }
+            }
+            else
+            {
+                out[p++] = QOI_OP_RGBA;
+                memcpy(out + p, px, 4);
+                p += 4;
+            }
+        }
+        memcpy(prev, px, 4);
+    }
+    if (run > 0)
+        out[p++] = QOI_OP_RUN | (run - 1);
+
+    memcpy(out + p, qoi_padding, QOI_PADDING_SIZE);
+    p += QOI_PADDING_SIZE;
+
+    *out_size = p;
+    return out;
+}
+
+static int qoi_decode(void *state, const unsigned char *data, size_t size, int w, int h, unsigned char *rgba)
+{
+    (void)state; // Decoding needs no scratch memory
+
+    if (size < QOI_HEADER_SIZE + QOI_PADDING_SIZE || memcmp(data, "qoif", 4) != 0)
+        return -1;
+    if (read_u32_be(data + 4) != (uint32_t)w || read_u32_be(data + 8) != (uint32_t)h)
+    {
+        debprintf("QOI size mismatch: expected %dx%d, got %ux%u\n", w, h, read_u32_be(data + 4), read_u32_be(data + 8));
+        return -1;
+    }
+
+    unsigned char index[64][4];
+    memset(index, 0, sizeof(index));
+    unsigned char px[4] = {0, 0, 0, 255};
+
+    size_t pixels = (size_t)w * h;
+    size_t end = size - QOI_PADDING_SIZE;
+    size_t p = QOI_HEADER_SIZE;
+    size_t i = 0;
+
+    while (i < pixels)
+    {
+        if (p >= end)
+            return -1; // Truncated
+
+        int op = data[p++];
+        if (op == QOI_OP_RGB)
+        {
+            if (end - p < 3)
+                return -1;
+            px[0] = data[p++];
+            px[1] = data[p++];
+            px[2] = data[p++];
+        }
+        else if (op == QOI_OP_RGBA)
+        {
+            if (end - p < 4)
+                return -1;
+            memcpy(px, data + p, 4);
+            p += 4;
+        }
+        else if ((op & QOI_MASK_2) == QOI_OP_INDEX)
+        {
+            memcpy(px, index[op], 4);
+        }
+        else if ((op & QOI_MASK_2) == QOI_OP_DIFF)
+        {
+            px[0] += ((op >> 4) & 0x03) - 2;
+            px[1] += ((op >> 2) & 0x03) - 2;
+            px[2] += (op & 0x03) - 2;
+        }
+        else if ((op & QOI_MASK_2) == QOI_OP_LUMA)
+        {
+            if (p >= end)
+                return -1;
+            int b2 = data[p++];
+            int vg = (op & 0x3f) - 32;
+            px[0] += vg - 8 + ((b2 >> 4) & 0x0f);
+            px[1] += vg;
+            px[2] += vg - 8 + (b2 & 0x0f);
+        }
+        else // QOI_OP_RUN
+        {
+            size_t run = (op & 0x3f) + 1;
+            if (run > pixels - i)
+                return -1;
+            for (; run > 0; run--, i++)
+                memcpy(rgba + i * 4, px, 4);
+            continue; // A run never changes the index
+        }
+
+        memcpy(index[qoi_hash(px)], px, 4);
+        memcpy(rgba + i * 4, px, 4);
+        i++;
+    }
+    return 0;
+}
+
+const struct frame_codec_ops qoi_frame_codec = {
+    .id = 2,
+    .name = "qoi",
+    .lossy = 0,
+    .has_quality = 0,
+    .create = qoi_create,
+    .destroy = qoi_destroy,
+    .encode = qoi_encode,
+    .decode = qoi_decode,
+};
@@ -0,0 +1,101 @@
+#define _GNU_SOURCE // memfd_create and file seals
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <linux/udmabuf.h>
+
+#include "dmabuf.h"
+
+void debprintf(const char *format, ...);
+
+struct dma_frames *dma_frames_create(int w, int h, int count)
+{
+    if (w <= 0 || h <= 0 || count <= 0)
+        return NULL;
+
+    // udmabuf only exports whole pages
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t frame_size = ((size_t)w * h * 4 + page - 1) / page * page;
+    size_t size = frame_size * count;
+
+    int dev = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+    if (dev < 0)
+    {
+        debprintf("Can't open /dev/udmabuf, no dma-buf frames\n");
+        return NULL;
+    }
+
+    struct dma_frames *frames = calloc(1, sizeof(struct dma_frames) + count * sizeof(struct dma_frame));
+    int memfd = memfd_create("vecpaper-dmabuf", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (!frames || memfd < 0 || ftruncate(memfd, (off_t)size) != 0 ||
+        fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) != 0) // udmabuf refuses memory that could shrink away
+    {
+        perror("Failed to create dma-buf memory");
+        if (memfd >= 0)
+            close(memfd);
+        free(frames);
+        close(dev);
+        return NULL;
+    }
+    frames->count = count;
+    frames->w = w;
+    frames->h = h;
+    frames->size = size;
+    for (int i = 0; i < count; i++)
+        frames->frames[i].fd = -1;
+
+    frames->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (frames->map == MAP_FAILED)
+    {
+        perror("mmap");
+        frames->map = NULL;
+        close(memfd);
+        close(dev);
+        dma_frames_destroy(frames);
+        return NULL;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        struct udmabuf_create create = {
+            .memfd = memfd,
+            .flags = UDMABUF_FLAGS_CLOEXEC,
+            .offset = i * frame_size,
+            .size = frame_size,
+        };
+        frames->frames[i].data = (unsigned char *)frames->map + i * frame_size;
+        frames->frames[i].fd = ioctl(dev, UDMABUF_CREATE, &create);
+        if (frames->frames[i].fd < 0)
+        {
+            perror("UDMABUF_CREATE");
+            close(memfd);
+            close(dev);
+            dma_frames_destroy(frames);
+            return NULL;
+        }
+    }
+    // The dma-bufs and the mapping keep the memory alive
+    close(memfd);
+    close(dev);
+
+    debprintf("Created %d dma-buf frames of %dx%d (%.1f MiB)\n", count, w, h, size / (1024.0 * 1024.0));
+    return frames;
+}
+
+void dma_frames_destroy(struct dma_frames *frames)
+{
+    if (!frames)
+        return;
+
+    for (int i = 0; i < frames->count; i++)
+    {
+        if (frames->frames[i].fd >= 0)
+            close(frames->frames[i].fd);
+    }
+    if (frames->map)
+        munmap(frames->map, frames->size);
+    free(frames);
+}
@@ -0,0 +1,355 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <wayland-client.h>
+#include "event_loop.h"
+
+void debprintf(const char *format, ...);
+
+// Most sources a single epoll_wait reports
+#define EVENT_LOOP_MAX_EVENTS 16
+
+enum source_kind
+{
+    SOURCE_FD,
+    SOURCE_WAYLAND,
+    SOURCE_TIMER,
+    SOURCE_SIGNAL, // fd is a signalfd the loop owns
+};
+
+struct event_source
+{
+    enum source_kind kind;
+    int fd;
+    event_loop_fn fn;
+    void *data;
+    int removed; // Freed once the dispatch that may still see it is done
+    struct event_source *next;
+};
+
+struct event_loop
+{
+    int epoll_fd;
+    struct wl_display *display;
+    struct wl_event_queue *queue; // NULL for the default queue
+    struct event_source *wayland;
+    uint32_t wayland_events; // What the Wayland fd is watched for right now
+    struct event_source *timer;
+    int stopped;
+    int dispatching;
+    struct event_source *sources;
+};
+
+static struct event_source *add_source(struct event_loop *loop, enum source_kind kind, int fd, uint32_t events, event_loop_fn fn,
+                                       void *data)
+{
+    struct event_source *source = calloc(1, sizeof(struct event_source));
+    if (!source)
+        return NULL;
+    source->kind = kind;
+    source->fd = fd;
+    source->fn = fn;
+    source->data = data;
+
+    struct epoll_event ev = {0};
+    ev.events = events;
+    ev.data.ptr = source;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+    {
+        perror("epoll_ctl");
+        free(source);
+        return NULL;
+    }
+    source->next = loop->sources;
+    loop->sources = source;
+    return source;
+}
+
+static void free_source(struct event_source *source)
+{
+    if (source->kind == SOURCE_TIMER || source->kind == SOURCE_SIGNAL)
+        close(source->fd);
+    free(source);
+}
+
+// Frees the sources removed while dispatching
+static void reap_sources(struct event_loop *loop)
+{
+    struct event_source **link = &loop->sources;
+    while (*link)
+    {
+        struct event_source *source = *link;
+        if (source->removed)
+        {
+            *link = source->next;
+            free_source(source);
+        }
+        else
+        {
+            link = &source->next;
+        }
+    }
+}
+
+struct event_loop *event_loop_create(struct wl_display *display, struct wl_event_queue *queue)
+{
+    struct event_loop *loop = calloc(1, sizeof(struct event_loop));
+    if (!loop)
+        return NULL;
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0)
+    {
+        perror("epoll_create1");
+        free(loop);
+        return NULL;
+    }
+
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0)
+    {
+        perror("timerfd_create");
+        event_loop_destroy(loop);
+        return NULL;
+    }
+    loop->timer = add_source(loop, SOURCE_TIMER, timer_fd, EPOLLIN, NULL, NULL);
+    if (!loop->timer)
+    {
+        close(timer_fd);
+        event_loop_destroy(loop);
+        return NULL;
+    }
+
+    if (display)
+    {
+        loop->display = display;
+        loop->queue = queue;
+        loop->wayland_events = EPOLLIN;
+        loop->wayland = add_source(loop, SOURCE_WAYLAND, wl_display_get_fd(display), EPOLLIN, NULL, NULL);
+        if (!loop->wayland)
+        {
+            event_loop_destroy(loop);
+            return NULL;
+        }
+    }
+    return loop;
+}
+
+void event_loop_destroy(struct event_loop *loop)
+{
+    if (!loop)
+        return;
+    while (loop->sources)
+    {
+        struct event_source *source = loop->sources;
+        loop->sources = source->next;
+        free_source(source);
+    }
+    close(loop->epoll_fd);
+    free(loop);
+}
+
+int event_loop_add_fd(struct event_loop *loop, int fd, uint32_t events, event_loop_fn fn, void *data)
+{
+    return add_source(loop, SOURCE_FD, fd, events, fn, data) ? 0 : -1;
+}
+
+void event_loop_remove_fd(struct event_loop *loop, int fd)
+{
+    for (struct event_source *source = loop->sources; source; source = source->next)
+    {
+        if (source->kind != SOURCE_FD || source->fd != fd || source->removed)
+            continue;
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        source->removed = 1;
+        break;
+    }
+    if (!loop->dispatching)
+        reap_sources(loop);
+}
+
+int event_loop_add_signal(struct event_loop *loop, int signo, event_loop_fn fn, void *data)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, signo);
+    if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0)
+        return -1;
+
+    int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0)
+    {
+        perror("signalfd");
+        pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+        return -1;
+    }
+    if (!add_source(loop, SOURCE_SIGNAL, fd, EPOLLIN, fn, data))
+    {
+        close(fd);
+        pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+        return -1;
+    }
+    return 0;
+}
+
+void event_loop_set_deadline(struct event_loop *loop, int64_t deadline)
+{
+    struct itimerspec spec = {0};
+    spec.it_value.tv_sec = (time_t)(deadline / 1000000000);
+    spec.it_value.tv_nsec = (long)(deadline % 1000000000);
+    // A zero it_value would disarm the timer instead of firing right away
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+        spec.it_value.tv_nsec = 1;
+    timerfd_settime(loop->timer->fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+static int prepare_read(struct event_loop *loop)
+{
+    if (loop->queue)
+        return wl_display_prepare_read_queue(loop->display, loop->queue);
+    return wl_display_prepare_read(loop->display);
+}
+
+static int dispatch_pending(struct event_loop *loop)
+{
+    if (loop->queue)
+        return wl_display_dispatch_queue_pending(loop->display, loop->queue);
+    return wl_display_dispatch_pending(loop->display);
+}
+
+// Reads from the Wayland fd when it is readable and dispatches everything that came in.
+// Called after epoll_wait with the read prepared, returns -1 if the connection is gone
+static int dispatch_wayland(struct event_loop *loop, uint32_t events)
+{
+    if (events & EPOLLIN)
+    {
+        if (wl_display_read_events(loop->display) == -1)
+            return -1;
+    }
+    else
+    {
+        wl_display_cancel_read(loop->display);
+        if (events & (EPOLLERR | EPOLLHUP))
+            return -1;
+    }
+    if (events & EPOLLOUT)
+    {
+        // The rest of what was queued fits into the socket now
+        if (wl_display_flush(loop->display) == -1 && errno != EAGAIN)
+            return -1;
+    }
+    return dispatch_pending(loop) == -1 ? -1 : 0;
+}
+
+static int dispatch_source(struct event_source *source, uint32_t events)
+{
+    switch (source->kind)
+    {
+    case SOURCE_FD:
+        return source->fn(source->data, events);
+    case SOURCE_TIMER:
+    {
+        // Only there to wake the wait up, the caller checks the clock itself
+        uint64_t expirations;
+        if (read(source->fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+            perror("timerfd read");
+        return 0;
+    }
+    case SOURCE_SIGNAL:
+    {
+        struct signalfd_siginfo info;
+        while (read(source->fd, &info, sizeof(info)) == sizeof(info))
+        {
+            debprintf("Caught signal %u\n", info.ssi_signo);
+            if (source->fn(source->data, events) < 0)
+                return -1;
+        }
+        return 0;
+    }
+    case SOURCE_WAYLAND:
+        break;
+    }
+    return 0;
+}
+
+int event_loop_dispatch(struct event_loop *loop, int timeout_ms)
+{
+    if (loop->stopped)
+        return -1;
+
+    if (loop->display)
+    {
+        // Reading is only allowed with nothing queued, so whatever is already queued goes first
+        while (prepare_read(loop) != 0)
+        {
+            if (dispatch_pending(loop) == -1)
+            {
+                loop->stopped = 1;
+                return -1;
+            }
+        }
+
+        // Requests have to reach the compositor before waiting for its answer. A full socket takes the
+        // rest once it is writable again
+        uint32_t wayland_events = EPOLLIN;
+        if (wl_display_flush(loop->display) == -1)
+        {
+            if (errno != EAGAIN)
+            {
+                wl_display_cancel_read(loop->display);
+                loop->stopped = 1;
+                return -1;
+            }
+            wayland_events |= EPOLLOUT;
+        }
+        if (wayland_events != loop->wayland_events)
+        {
+            struct epoll_event ev = {0};
+            ev.events = wayland_events;
+            ev.data.ptr = loop->wayland;
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, loop->wayland->fd, &ev);
+            loop->wayland_events = wayland_events;
+        }
+    }
+
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    int count = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_EVENTS, timeout_ms);
+    if (count < 0)
+    {
+        if (errno != EINTR)
+            perror("epoll_wait");
+        count = 0; // Only a stray signal, the caller waits again if it still has to
+    }
+
+    loop->dispatching = 1;
+    if (loop->display)
+    {
+        uint32_t wayland_events = 0;
+        for (int i = 0; i < count; i++)
+        {
+            if (events[i].data.ptr == loop->wayland)
+                wayland_events = events[i].events;
+        }
+        // The prepared read has to be finished or cancelled either way
+        if (dispatch_wayland(loop, wayland_events) == -1)
+            loop->stopped = 1;
+    }
+    for (int i = 0; i < count && !loop->stopped; i++)
+    {
+        struct event_source *source = events[i].data.ptr;
+        if (source->removed)
+            continue;
+        if (dispatch_source(source, events[i].events) < 0)
+            loop->stopped = 1;
+    }
+    loop->dispatching = 0;
+    reap_sources(loop);
+
+    return loop->stopped ? -1 : 0;
+}
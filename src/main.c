@@ -1,23 +1,35 @@
 #define _POSIX_C_SOURCE 200809L
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <sys/stat.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
 #include <math.h>
 #include <signal.h>
+#include <errno.h>
 #include <stdbool.h>
-#include <jpeglib.h>
-#include <setjmp.h>
 #include <regex.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include <wayland-client.h>
 #include <wayland-egl.h>
 #include <EGL/egl.h>
-#include <GLES2/gl2.h>
+#include <EGL/eglext.h>
+#include <GLES3/gl3.h> // Only used as GLES2 unless the context is GLES3, see init_egl
+#include <GLES2/gl2ext.h>
 #include "wlr-layer-shell-unstable-v1-client-protocol.h"
 #include "argparse.h"
+#include "bundle.h"
+#include "cache.h"
+#include "codec.h"
+#include "dmabuf.h"
+#include "event_loop.h"
+#include "message_queue.h"
+#include "shm.h"
 
 // Globals
 char debug = 0;
@@ -25,13 +37,19 @@ double FRAME_TIME;
 char *screenset;
 int cache_length;
 GLuint passthrough_program = 0;
-GLuint cache_tex = 0;
-struct cached_frame
-{
-    unsigned char *jpeg_data;
-    size_t jpeg_size;
-};
+GLuint cache_tex = 0;             // RGBA frame, or the Y plane in YUV mode
+GLuint cache_chroma_tex[2] = {0}; // Cb and Cr planes in YUV mode
 struct cached_frame *frame_cache = NULL;
+struct frame_arena *cache_arena = NULL; // Holds the data of every frame in frame_cache once built
+struct encode_pool *encoder_pool = NULL;
+struct decode_ring *decoder_ring = NULL;
+struct cache_file *frame_cache_file = NULL; // Set when frame_cache points into a mapped cache file
+struct cache_share *frame_cache_share = NULL; // Set when frame_cache points into the copy shared with other instances
+struct bundle *wallpaper_bundle = NULL;       // Set when the shader came from a .vpk, frame_cache may point into it
+GLuint *gpu_frames = NULL;                  // Whole loop as textures when it fits in video memory
+struct dma_frames *dma_frames = NULL;       // Decoded frames the GPU samples in place, see import_dma_frames
+EGLImageKHR *dma_images = NULL;
+GLuint *dma_textures = NULL; // GL_TEXTURE_EXTERNAL_OES, one per dma frame
 
 struct wl_state;
 struct display_output;
@@ -39,23 +57,80 @@ struct display_output;
 struct display_output *target_display = NULL; // NULL initially
 int output_count = 0;
 struct wl_display *display;
+struct event_loop *main_loop = NULL; // Everything playback waits on, see event_loop.h
+struct wl_event_queue *render_queue = NULL; // Events for the render thread, main_loop dispatches it
 struct wl_compositor *compositor;
 struct wl_surface *surface;
+struct wl_surface *render_surface = NULL; // Wrapper of surface, frame callbacks from it land on render_queue
 struct wl_registry *registry;
 struct zwlr_layer_shell_v1 *layer_shell;
 struct zwlr_layer_surface_v1 *layer_surface;
+struct wl_shm *shm;
+struct wl_shm *render_shm = NULL;     // Wrapper of shm, buffer releases land on render_queue
+bool shm_xbgr = false;                // Compositor takes XBGR8888 shm buffers, which is RGBA in memory
+struct shm_frames *shm_frames = NULL; // Cache playback without GL, see play_cache_shm
 struct wl_egl_window *egl_win;
 GLuint shader_program;
+GLint resolution_loc = -1; // "resolution" uniform of shader_program
 double global_time = 0.0;
 
 struct wl_list outputs;
 
+// Everything on the default queue (configure, output changes, closed) is dispatched on wayland_thread,
+// so a slow frame never holds up the connection. Handlers only answer the compositor and leave the
+// rest to the render thread through wayland_messages
+struct event_loop *wayland_loop = NULL;
+struct message_queue *wayland_messages = NULL;
+pthread_t wayland_thread;
+bool wayland_thread_running = false;
+int wayland_stop_fd = -1; // Written to stop wayland_thread
+
+enum wayland_message_type
+{
+    MSG_CONFIGURE,    // a x b is the size the compositor gave the layer surface
+    MSG_OUTPUT_MODE,  // a x b is the new mode of the target output
+    MSG_CLOSED,       // The compositor closed the layer surface
+    MSG_DISCONNECTED, // wayland_thread stopped dispatching
+};
+
+// Room for far more messages than arrive between two frames
+#define WAYLAND_MESSAGES 64
+
 EGLDisplay egl_display;
 EGLContext egl_context;
 EGLSurface egl_surface;
 EGLConfig egl_config;
+bool gles3 = false; // Context supports GLES3, cache readback goes through PBOs
 GLuint vbo = 0;
 
+// How many frames the playback decoder may run ahead
+#define CACHE_PREFETCH_FRAMES 4
+
+// dma-buf playback: frames the decoder can write into, and how many of them playback keeps
+// (the one being drawn and the one before, which the GPU may still be sampling)
+#define DMA_FRAMES (CACHE_PREFETCH_FRAMES + 2)
+#define DMA_FRAMES_HELD 2
+
+// DRM_FORMAT_ABGR8888 ('AB24'), R, G, B, A bytes in memory
+#define DMA_FORMAT_ABGR8888 0x34324241
+
+// Shared memory playback: one buffer on screen, one queued at the compositor and the decoder's
+#define SHM_FRAMES (CACHE_PREFETCH_FRAMES + 2)
+
+// A frame callback this late means the compositor stopped presenting the surface, see wait_for_frame
+#define HIDDEN_AFTER_MS 500
+
+// How many frames the GPU may render ahead of the one being read back while caching
+#define READBACK_DEPTH 3
+
+// Memory budget trials: frames sampled over the loop, the SSIM a lossy cache should keep,
+// the lowest quality tried and the smallest cache size tried
+#define BUDGET_SAMPLE_FRAMES 4
+#define BUDGET_TARGET_SSIM 0.95
+#define BUDGET_MIN_QUALITY 20
+#define BUDGET_MIN_SIZE 64
+#define BUDGET_MAX_QUALITIES 16
+
 // Static variables
 GLfloat VERTS[] = {-1, -1, 1, -1, -1, 1, 1, 1};
 
@@ -83,6 +158,33 @@ static const char *passthrough_fragment_src =
     "    gl_FragColor = texture2D(tex, uv);\n"
     "}\n";
 
+// Passthrough for decoded frames imported from dma-bufs
+static const char *external_fragment_src =
+    "#extension GL_OES_EGL_image_external : require\n"
+    "precision mediump float;\n"
+    "uniform samplerExternalOES tex;\n"
+    "varying vec2 uv;\n"
+    "void main() {\n"
+    "    gl_FragColor = texture2D(tex, uv);\n"
+    "}\n";
+
+// Passthrough for frames decoded to YUV 4:2:0 planes, converts JFIF YCbCr to RGB
+// uv_scale crops the MCU padding off the planes
+static const char *yuv_fragment_src =
+    "precision mediump float;\n"
+    "uniform sampler2D tex_y;\n"
+    "uniform sampler2D tex_cb;\n"
+    "uniform sampler2D tex_cr;\n"
+    "uniform vec2 uv_scale;\n"
+    "varying vec2 uv;\n"
+    "void main() {\n"
+    "    vec2 p = uv * uv_scale;\n"
+    "    float y = texture2D(tex_y, p).r;\n"
+    "    float cb = texture2D(tex_cb, p).r - 128.0 / 255.0;\n"
+    "    float cr = texture2D(tex_cr, p).r - 128.0 / 255.0;\n"
+    "    gl_FragColor = vec4(y + 1.402 * cr, y - 0.344136 * cb - 0.714136 * cr, y + 1.772 * cb, 1.0);\n"
+    "}\n";
+
 // Structures
 struct wl_state
 {
@@ -149,9 +251,13 @@ static void cleanup_display_output(struct display_output *output)
 }
 
 // Clean everything before exiting
+static void stop_wayland_thread(void);
+
 static void cleanup(void) {
     debprintf("Cleaning up resources\n");
 
+    stop_wayland_thread(); // Nothing may dispatch while the objects go away
+
     struct display_output *output, *tmp;
     wl_list_for_each_safe(output, tmp, &outputs, link) {
         cleanup_display_output(output);
@@ -162,6 +268,7 @@ static void cleanup(void) {
     if (vbo) glDeleteBuffers(1, &vbo);
 
     if (layer_surface) zwlr_layer_surface_v1_destroy(layer_surface);
+    if (render_surface) wl_proxy_wrapper_destroy(render_surface);
     if (surface) wl_surface_destroy(surface);
     if (layer_shell) zwlr_layer_shell_v1_destroy(layer_shell);
     
@@ -177,15 +284,42 @@ static void cleanup(void) {
         eglTerminate(egl_display);
     }
 
+    // Workers may still be using frame_cache, stop them first
+    encode_pool_destroy(encoder_pool);
+    encoder_pool = NULL;
+    decode_ring_destroy(decoder_ring);
+    decoder_ring = NULL;
+    shm_frames_destroy(shm_frames); // The decoder writes into these
+    shm_frames = NULL;
+    dma_frames_destroy(dma_frames); // Their EGLImages went with eglTerminate
+    dma_frames = NULL;
+    free(dma_images);
+    free(dma_textures);
+    if (render_shm) wl_proxy_wrapper_destroy(render_shm);
+    if (shm) wl_shm_destroy(shm);
+
     if (cache_length > 0) {
-        for (int i = 0; i < cache_length; i++) {
-            free(frame_cache[i].jpeg_data);
-        }
+        cache_file_unmap(frame_cache_file);
+        cache_share_destroy(frame_cache_share);
+        frame_arena_destroy(cache_arena); // Every encoded frame at once
         free(frame_cache);
+        if (gpu_frames) {
+            glDeleteTextures(cache_length, gpu_frames);
+            free(gpu_frames);
+        }
         glDeleteTextures(1, &cache_tex);
+        glDeleteTextures(2, cache_chroma_tex);
         if (passthrough_program) glDeleteProgram(passthrough_program);
     }
 
+    bundle_close(wallpaper_bundle);
+    wallpaper_bundle = NULL;
+
+    event_loop_destroy(main_loop);
+    main_loop = NULL;
+    message_queue_destroy(wayland_messages);
+    wayland_messages = NULL;
+    if (render_queue) wl_event_queue_destroy(render_queue);
     if (display) wl_display_disconnect(display);
 
     debprintf("Cleanup complete\n");
@@ -256,178 +390,6 @@ void debprintf(const char *format, ...)
     va_end(args);
 }
 
-// JPEG error handling
-struct jpeg_error_mgr_jmp
-{
-    struct jpeg_error_mgr pub;
-    jmp_buf setjmp_buffer;
-};
-typedef struct jpeg_error_mgr_jmp *jpeg_error_mgr_jmp_ptr;
-
-static void jpeg_error_exit_jmp(j_common_ptr cinfo)
-{
-    jpeg_error_mgr_jmp_ptr myerr = (jpeg_error_mgr_jmp_ptr)cinfo->err;
-    longjmp(myerr->setjmp_buffer, 1);
-}
-
-// Compress RGBA into JPEG in memory
-static unsigned char *compress_jpeg(unsigned char *rgba, int w, int h, int quality, size_t *out_size)
-{
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr_jmp jerr = {0}; // Zero-init
-
-    // Zero-init cinfo
-    memset(&cinfo, 0, sizeof(cinfo));
-    cinfo.err = jpeg_std_error(&jerr.pub);
-    jerr.pub.error_exit = jpeg_error_exit_jmp;
-
-    if (setjmp(jerr.setjmp_buffer))
-    {
-        jpeg_destroy_compress(&cinfo);
-        return NULL;
-    }
-
-    jpeg_create_compress(&cinfo);
-
-    unsigned char *outbuffer = NULL;
-    unsigned long outsize = 0;
-    jpeg_mem_dest(&cinfo, &outbuffer, &outsize);
-
-    cinfo.image_width = w;
-    cinfo.image_height = h;
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_RGB;
-
-    jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, quality, TRUE);
-
-    (void)jpeg_start_compress(&cinfo, TRUE); // Cast to void
-
-    JSAMPROW row_pointer[1];
-    int row_stride = w * 3;
-    unsigned char *rgb_row = malloc(row_stride); // One row RGB
-    if (!rgb_row)
-    {
-        jpeg_destroy_compress(&cinfo);
-        return NULL;
-    }
-
-    while (cinfo.next_scanline < cinfo.image_height)
-    {
-        int y = cinfo.next_scanline;
-
-        // Copy RGBA row into RGB (drop alpha)
-        for (int x = 0; x < w; x++)
-        {
-            int rgba_idx = (y * w + x) * 4;
-            int rgb_idx = x * 3;
-            rgb_row[rgb_idx + 0] = rgba[rgba_idx + 0]; // R
-            rgb_row[rgb_idx + 1] = rgba[rgba_idx + 1]; // G
-            rgb_row[rgb_idx + 2] = rgba[rgba_idx + 2]; // B
-        }
-
-        row_pointer[0] = rgb_row;
-        if (jpeg_write_scanlines(&cinfo, row_pointer, 1) != 1)
-        {
-            free(rgb_row);
-            jpeg_destroy_compress(&cinfo);
-            return NULL;
-        }
-    }
-
-    jpeg_finish_compress(&cinfo);
-    jpeg_destroy_compress(&cinfo);
-    free(rgb_row);
-
-    *out_size = outsize;
-    return outbuffer;
-}
-
-// Decompress JPEG into RGBA
-static unsigned char *decompress_jpeg(unsigned char *jpeg_data, size_t jpeg_size, int w, int h)
-{
-    struct jpeg_decompress_struct cinfo;
-    struct jpeg_error_mgr_jmp jerr = {0}; // Zero-init error struct
-
-    // Zero-init cinfo to avoid garbage
-    memset(&cinfo, 0, sizeof(cinfo));
-    cinfo.err = jpeg_std_error(&jerr.pub);
-    jerr.pub.error_exit = jpeg_error_exit_jmp;
-
-    if (setjmp(jerr.setjmp_buffer))
-    {
-        jpeg_destroy_decompress(&cinfo);
-        return NULL; // Error - jump out
-    }
-
-    jpeg_create_decompress(&cinfo);
-    jpeg_mem_src(&cinfo, jpeg_data, jpeg_size);
-    (void)jpeg_read_header(&cinfo, TRUE); // Cast to void to ignore the warnings
-    (void)jpeg_start_decompress(&cinfo);
-
-    if (cinfo.output_width != (unsigned int)w || cinfo.output_height != (unsigned int)h)
-    {
-        debprintf("JPEG size mismatch: expected %dx%d, got %dx%d\n", w, h, cinfo.output_width, cinfo.output_height);
-        jpeg_destroy_decompress(&cinfo);
-        return NULL;
-    }
-
-    unsigned char *rgba = malloc((size_t)w * h * 4); // RGBA output
-    if (!rgba)
-    {
-        jpeg_destroy_decompress(&cinfo);
-        return NULL;
-    }
-
-    // RGB temp buffer for one row (libjpeg outputs RGB)
-    unsigned char *rgb_row = malloc((size_t)w * 3);
-    if (!rgb_row)
-    {
-        free(rgba);
-        jpeg_destroy_decompress(&cinfo);
-        return NULL;
-    }
-
-    JSAMPROW row_pointer[1];  // Array of pointers for libjpeg
-    row_pointer[0] = rgb_row; // Point to valid RGB buffer
-
-    // int row_stride = cinfo.output_width * cinfo.output_components;  // 3 for RGB
-
-    // Loop: read each row, copy to RGBA
-    while (cinfo.output_scanline < cinfo.output_height)
-    {
-        // READ: Fill rgb_row via row_pointer
-        if (jpeg_read_scanlines(&cinfo, row_pointer, 1) != 1)
-        {
-            debprintf("Failed to read scanline %d\n", cinfo.output_scanline);
-            free(rgba);
-            free(rgb_row);
-            jpeg_finish_decompress(&cinfo);
-            jpeg_destroy_decompress(&cinfo);
-            return NULL;
-        }
-
-        // Current row index (scanline starts at 0)
-        int row_idx = cinfo.output_scanline - 1; // After read, its incremented
-
-        // Copy RGB into RGBA (add alpha=255)
-        for (int x = 0; x < w; x++)
-        {
-            int rgb_offset = x * 3;
-            int rgba_offset = (row_idx * w + x) * 4;
-            rgba[rgba_offset + 0] = rgb_row[rgb_offset + 0]; // R
-            rgba[rgba_offset + 1] = rgb_row[rgb_offset + 1]; // G
-            rgba[rgba_offset + 2] = rgb_row[rgb_offset + 2]; // B
-            rgba[rgba_offset + 3] = 255;                     // A
-        }
-    }
-
-    free(rgb_row);
-    jpeg_finish_decompress(&cinfo);
-    jpeg_destroy_decompress(&cinfo);
-    return rgba;
-}
-
 // = Wayland callbacks section =
 
 // Wayland callbacks prototypes
@@ -435,6 +397,8 @@ static void layer_surface_configure(void *data, struct zwlr_layer_surface_v1 *su
 static void layer_surface_closed(void *data, struct zwlr_layer_surface_v1 *surf);
 static void registry_global(void *data, struct wl_registry *registry, uint32_t name, const char *interface, uint32_t version);
 static void registry_remove(void *data, struct wl_registry *registry, uint32_t name) {}; // NOP
+static void shm_format(void *data, struct wl_shm *wl_shm, uint32_t format);
+static void post_wayland_message(int type, int32_t a, int32_t b);
 
 static void output_done(void *data, struct wl_output *wl_output);
 static void output_scale(void *data, struct wl_output *wl_output, int32_t scale)
@@ -481,6 +445,12 @@ static void output_mode(void *data, struct wl_output *wl_output, uint32_t flags,
     // Only store the current mode
     if (flags & WL_OUTPUT_MODE_CURRENT)
     {
+        // The render thread owns the size of the output it plays on
+        if (wayland_thread_running && output == target_display)
+        {
+            post_wayland_message(MSG_OUTPUT_MODE, width, height);
+            return;
+        }
         output->width = width;
         output->height = height;
     }
@@ -497,6 +467,10 @@ static const struct wl_registry_listener registry_listener = {
     .global_remove = registry_remove,
 };
 
+static const struct wl_shm_listener shm_listener = {
+    .format = shm_format,
+};
+
 static const struct wl_output_listener output_listener = {
     .geometry = output_geometry,
     .mode = output_mode,
@@ -507,18 +481,32 @@ static const struct wl_output_listener output_listener = {
 };
 
 // Wayland callbacks functions
+// Hands a change over to the render thread, see handle_wayland_messages
+static void post_wayland_message(int type, int32_t a, int32_t b)
+{
+    struct message msg = {type, a, b};
+    int ret = message_queue_push(wayland_messages, &msg);
+    if (ret == -1)
+    {
+        debprintf("Wayland message queue is full, dropping message %d\n", type);
+    }
+    else if (ret != 0)
+    {
+        perror("Waking the render thread");
+        debprintf("Dropping Wayland message %d\n", type);
+    }
+}
+
 static void layer_surface_configure(void *data, struct zwlr_layer_surface_v1 *surf,
                                     uint32_t serial, uint32_t w, uint32_t h)
 {
     zwlr_layer_surface_v1_ack_configure(surf, serial);
+    post_wayland_message(MSG_CONFIGURE, (int32_t)w, (int32_t)h);
 }
 
 static void layer_surface_closed(void *data, struct zwlr_layer_surface_v1 *surf)
 {
-    debprintf("Layer surface closed\n");
-    wl_display_disconnect(display);
-    cleanup();
-    exit(0);
+    post_wayland_message(MSG_CLOSED, 0, 0);
 }
 
 static void registry_global(void *data, struct wl_registry *registry,
@@ -532,6 +520,11 @@ static void registry_global(void *data, struct wl_registry *registry,
     {
         layer_shell = wl_registry_bind(registry, name, &zwlr_layer_shell_v1_interface, 1);
     }
+    else if (strcmp(interface, wl_shm_interface.name) == 0)
+    {
+        shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+        wl_shm_add_listener(shm, &shm_listener, NULL);
+    }
 
     struct wl_state *state = data;
     if (strcmp(interface, wl_output_interface.name) == 0)
@@ -549,6 +542,12 @@ static void registry_global(void *data, struct wl_registry *registry,
     }
 }
 
+static void shm_format(void *data, struct wl_shm *wl_shm, uint32_t format)
+{
+    if (format == WL_SHM_FORMAT_XBGR8888)
+        shm_xbgr = true;
+}
+
 static void output_done(void *data, struct wl_output *wl_output)
 {
     (void)wl_output;
@@ -558,6 +557,10 @@ static void output_done(void *data, struct wl_output *wl_output)
     debprintf("Output ID %u → Name: '%s', Identifier: '%s'\n",
               output->wl_name, output->name, output->identifier);
 
+    // The surface is already on its output
+    if (wayland_thread_running)
+        return;
+
     if (screenset == NULL || strcmp(output->name, screenset) == 0)
     {
         target_display = data;
@@ -566,13 +569,13 @@ static void output_done(void *data, struct wl_output *wl_output)
     }
 }
 
-static void init_egl(struct wl_display *dpy, struct wl_surface *surf)
+// Display, config and context for surfaces of surface_type.
+// want_gles3 asks for a GLES3 context when available, falling back to GLES2
+static void init_egl_context(EGLNativeDisplayType dpy, EGLint surface_type, bool want_gles3)
 {
-    if (egl_display != EGL_NO_DISPLAY) return;
-
     EGLint major, minor, n;
 
-    egl_display = eglGetDisplay((EGLNativeDisplayType)dpy);
+    egl_display = eglGetDisplay(dpy);
 
     if (egl_display == EGL_NO_DISPLAY) {
         fprintf(stderr, "Failed to get EGL display\n");
@@ -586,8 +589,8 @@ static void init_egl(struct wl_display *dpy, struct wl_surface *surf)
         exit(1);
     }
 
-    static const EGLint config_attribs[] = {
-        EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
+    const EGLint config_attribs[] = {
+        EGL_SURFACE_TYPE, surface_type,
         EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
         EGL_RED_SIZE, 8,
         EGL_GREEN_SIZE, 8,
@@ -600,8 +603,18 @@ static void init_egl(struct wl_display *dpy, struct wl_surface *surf)
     eglChooseConfig(egl_display, config_attribs, &egl_config, 1, &n);
     eglBindAPI(EGL_OPENGL_ES_API);
 
-    static const EGLint ctx_attribs[] = {EGL_CONTEXT_CLIENT_VERSION, 2, EGL_NONE};
-    egl_context = eglCreateContext(egl_display, egl_config, EGL_NO_CONTEXT, ctx_attribs);
+    if (want_gles3)
+    {
+        // GLSL ES 1.00 shaders keep working on a GLES3 context
+        static const EGLint gles3_ctx_attribs[] = {EGL_CONTEXT_CLIENT_VERSION, 3, EGL_NONE};
+        egl_context = eglCreateContext(egl_display, egl_config, EGL_NO_CONTEXT, gles3_ctx_attribs);
+        gles3 = egl_context != EGL_NO_CONTEXT;
+    }
+    if (!gles3)
+    {
+        static const EGLint ctx_attribs[] = {EGL_CONTEXT_CLIENT_VERSION, 2, EGL_NONE};
+        egl_context = eglCreateContext(egl_display, egl_config, EGL_NO_CONTEXT, ctx_attribs);
+    }
 
     if (egl_context == EGL_NO_CONTEXT)
     {
@@ -609,7 +622,14 @@ static void init_egl(struct wl_display *dpy, struct wl_surface *surf)
         cleanup();
         exit(1);
     }
-    debprintf("Created EGL context\n");
+    debprintf("Created GLES%d EGL context\n", gles3 ? 3 : 2);
+}
+
+static void init_egl(struct wl_display *dpy, struct wl_surface *surf, bool want_gles3)
+{
+    if (egl_display != EGL_NO_DISPLAY) return;
+
+    init_egl_context((EGLNativeDisplayType)dpy, EGL_WINDOW_BIT, want_gles3);
 
     egl_win = wl_egl_window_create(surf, target_display->width, target_display->height);
     egl_surface = eglCreateWindowSurface(egl_display, egl_config, egl_win, NULL);
@@ -617,6 +637,27 @@ static void init_egl(struct wl_display *dpy, struct wl_surface *surf)
 
     eglMakeCurrent(egl_display, egl_surface, egl_surface, egl_context);
     glViewport(0, 0, target_display->width, target_display->height);
+
+    // Never block in eglSwapBuffers, playback waits for frame callbacks itself (see wait_for_frame)
+    // and cache builds must not be paced at all
+    eglSwapInterval(egl_display, 0);
+}
+
+// Offscreen context for --bake, there is no compositor to show anything on
+static void init_egl_headless(void)
+{
+    init_egl_context(EGL_DEFAULT_DISPLAY, EGL_PBUFFER_BIT, true);
+
+    // Everything is rendered into framebuffer objects, the surface only makes the context current
+    static const EGLint pbuffer_attribs[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+    egl_surface = eglCreatePbufferSurface(egl_display, egl_config, pbuffer_attribs);
+    if (egl_surface == EGL_NO_SURFACE || !eglMakeCurrent(egl_display, egl_surface, egl_surface, egl_context))
+    {
+        fprintf(stderr, "Failed to create an offscreen EGL surface\n");
+        cleanup();
+        exit(1);
+    }
+    debprintf("Created offscreen EGL surface\n");
 }
 
 static GLuint compile_shader(GLenum type, const char *src)
@@ -879,121 +920,1332 @@ void handle_sigint(int sig)
     exit(0);
 }
 
-int main(int argc, const char **argv)
+// Stops the loop it is called from: SIGINT and SIGTERM let playback clean up normally, and
+// wayland_stop_fd ends wayland_thread
+static int stop_event_loop(void *data, uint32_t events)
 {
-    signal(SIGINT, handle_sigint);
-
-    bool running_hyprland = false; // Using hyprctl for cursor position (for now), so must check if its hyprland or not before trying hyprctl
-
-    char *fragment_shader_file = NULL;
-    screenset = NULL;
-    char *convertfile = NULL;
-    bool runtimeconvertfile = false;
-    int fps = 60;
-
-    int cache_seconds = 0;
-    int cache_quality = 75;
-
-    struct argparse_option options[] = {
-        OPT_HELP(),
-        OPT_STRING('c', "convert", &convertfile, "Convert a file with a shadertoy shader and exit. (WARNING: the file will be overwritten. If you don't want it to be overwritten, please consider runtime convert option)"),
-        OPT_BOOLEAN('r', "rt-convert", &runtimeconvertfile, "Convert the shader file with shadertoy shader in runtime without modifying the file"),
-        OPT_STRING('s', "shader", &fragment_shader_file, "Path to the fragment shader"),
-        OPT_STRING(0, "monitor", &screenset, "A monitor to which the shader will be rendered"), // Should be '*' or MONITOR1,MONITOR2 when multimonitor setups will be supported
-        OPT_BOOLEAN('d', "debug", &debug, "Option to get debug outputs", 0, 0),
-        OPT_INTEGER('f', "fps", &fps, "Frames per second"),
-        OPT_INTEGER(0, "cache", &cache_seconds, "Amount of seconds for caching (looping). Useful when you dont want to compute the shader over and over."),
-        OPT_INTEGER(0, "cache-quality", &cache_quality, "Caching quality (JPEG compression quality) 10-100 (default 75)"),
-        OPT_END(),
-    };
-    struct argparse argparse;
-    argparse_init(&argparse, options, NULL, 0);
-    argparse_parse(&argparse, argc, argv);
-
-    debprintf("Running in debug mode\n");
+    (void)data;
+    (void)events;
+    return -1;
+}
 
-    const char *hypr = getenv("HYPRLAND_INSTANCE_SIGNATURE");
+// Render thread side of wayland_messages, called from main_loop
+static int handle_wayland_messages(void *data, uint32_t events)
+{
+    (void)data;
+    (void)events;
 
-    if (hypr)
-    {
-        debprintf("Running hyprland\n");
-        running_hyprland = true;
-    }
-    else
+    struct message msg;
+    while (message_queue_pop(wayland_messages, &msg))
     {
-        debprintf("Not running under Hyprland.\n");
+        switch (msg.type)
+        {
+        case MSG_CONFIGURE:
+            // The surface asks for the size of the output, so anything else is the compositor's choice
+            if (msg.a > 0 && msg.b > 0 && ((uint32_t)msg.a != target_display->width || (uint32_t)msg.b != target_display->height))
+            {
+                debprintf("Layer surface configured to %dx%d, still rendering at %ux%u\n", msg.a, msg.b, target_display->width,
+                          target_display->height);
+            }
+            break;
+        case MSG_OUTPUT_MODE:
+            debprintf("Output mode changed to %dx%d, still rendering at %ux%u\n", msg.a, msg.b, target_display->width,
+                      target_display->height);
+            break;
+        case MSG_CLOSED:
+            debprintf("Layer surface closed\n");
+            return -1;
+        case MSG_DISCONNECTED:
+            return -1;
+        }
     }
+    return 0;
+}
 
-    if (convertfile && runtimeconvertfile)
+static void *wayland_thread_main(void *data)
+{
+    (void)data;
+    while (event_loop_dispatch(wayland_loop, -1) != -1)
+        ;
+    post_wayland_message(MSG_DISCONNECTED, 0, 0); // Nobody is listening anymore if it was stopped
+    return NULL;
+}
+
+// Takes the default queue off the render thread, call once the surface is set up
+static bool start_wayland_thread(void)
+{
+    wayland_stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    wayland_loop = event_loop_create(display, NULL);
+    if (wayland_stop_fd < 0 || !wayland_loop || event_loop_add_fd(wayland_loop, wayland_stop_fd, EPOLLIN, stop_event_loop, NULL) != 0)
+        return false;
+
+    wayland_thread_running = true; // Before the handlers can run there
+    if (pthread_create(&wayland_thread, NULL, wayland_thread_main, NULL) != 0)
     {
-        fprintf(stderr, "The file should be either converted at runtime or with file modifiying. Specify either convert or either runtimeconvert file, not both\n");
-        cleanup();
-        exit(1);
+        wayland_thread_running = false;
+        return false;
     }
+    return true;
+}
 
-    if (convertfile != NULL)
+static void stop_wayland_thread(void)
+{
+    if (wayland_thread_running)
     {
-        // Read the input shader
-        char *shader_src = read_file(convertfile);
-        if (!shader_src)
+        uint64_t one = 1;
+        ssize_t written = write(wayland_stop_fd, &one, sizeof(one));
+        while (written < 0 && errno == EINTR)
+            written = write(wayland_stop_fd, &one, sizeof(one));
+        if (written != sizeof(one))
         {
-            fprintf(stderr, "Failed to read %s\n", convertfile);
-            exit(1);
+            // The thread has to be gone before its loop is freed, epoll_wait is a cancellation point
+            perror("Stopping the Wayland thread");
+            pthread_cancel(wayland_thread);
         }
+        pthread_join(wayland_thread, NULL);
+        wayland_thread_running = false;
+    }
+    event_loop_destroy(wayland_loop);
+    wayland_loop = NULL;
+    if (wayland_stop_fd >= 0)
+        close(wayland_stop_fd);
+    wayland_stop_fd = -1;
+}
 
-        // Convert the shader
-        char *converted_shader = convert_shadertoy(shader_src);
-        free(shader_src); // free original buffer
-        if (!converted_shader)
-        {
-            fprintf(stderr, "Failed to convert shader.\n");
-            cleanup();
-            exit(1);
-        }
+static GLuint create_playback_texture(GLint filter)
+{
+    GLuint tex;
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    return tex;
+}
 
-        // Overwrite the file with converted shader
-        FILE *f = fopen(convertfile, "w");
-        if (!f)
-        {
-            fprintf(stderr, "Failed to open %s for writing\n", convertfile);
-            free(converted_shader);
-            cleanup();
-            exit(1);
-        }
-        fputs(converted_shader, f);
-        fclose(f);
-        free(converted_shader);
+// Texture that cached frames get uploaded into every frame
+static GLuint create_cache_texture(GLenum format, int w, int h, GLint filter)
+{
+    GLuint tex = create_playback_texture(filter);
+    glTexImage2D(GL_TEXTURE_2D, 0, format, w, h, 0, format, GL_UNSIGNED_BYTE, NULL);
+    return tex;
+}
 
-        printf("Shader converted and saved to %s\n", convertfile);
+// Same for a compressed texture codec, holding frame to begin with since GLES can't allocate those empty
+static GLuint create_compressed_cache_texture(GLenum format, int w, int h, GLint filter, const struct cached_frame *frame)
+{
+    GLuint tex = create_playback_texture(filter);
+    glCompressedTexImage2D(GL_TEXTURE_2D, 0, format, w, h, 0, (GLsizei)frame->size, frame->data);
+    return tex;
+}
 
-        cleanup();
-        exit(0); // Exit after overwriting
+// Whether name is one of the space separated extensions in list
+static bool has_extension(const char *list, const char *name)
+{
+    size_t len = strlen(name);
+    for (const char *p = list; p && (p = strstr(p, name)) != NULL; p += len)
+    {
+        if ((p == list || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\0'))
+            return true;
     }
+    return false;
+}
 
-    if (fragment_shader_file == NULL)
+static PFNEGLCREATEIMAGEKHRPROC egl_create_image;
+static PFNEGLDESTROYIMAGEKHRPROC egl_destroy_image;
+static PFNGLEGLIMAGETARGETTEXTURE2DOESPROC gl_image_target_texture;
+static PFNEGLCREATESYNCKHRPROC egl_create_sync;
+static PFNEGLCLIENTWAITSYNCKHRPROC egl_client_wait_sync;
+static PFNEGLDESTROYSYNCKHRPROC egl_destroy_sync;
+
+// Drops dma_frames along with their textures and EGLImages while the context is still current
+static void destroy_dma_frames(void)
+{
+    for (int i = 0; dma_frames && i < DMA_FRAMES; i++)
     {
-        fprintf(stderr, "Shader file was not specified\n");
-        exit(1);
-    }
+        if (dma_textures && dma_textures[i])
+            glDeleteTextures(1, &dma_textures[i]);
+        if (dma_images && dma_images[i] != EGL_NO_IMAGE_KHR)
+            egl_destroy_image(egl_display, dma_images[i]);
+    }
+    free(dma_images);
+    free(dma_textures);
+    dma_images = NULL;
+    dma_textures = NULL;
+    dma_frames_destroy(dma_frames);
+    dma_frames = NULL;
+}
 
-    debprintf("Reading %s\n", fragment_shader_file);
-    char *fragment_shader_src = read_file(fragment_shader_file);
-    if (!fragment_shader_src)
+// Gives the oldest frame playback took from the ring back once the GPU is done sampling it.
+// next is the slot of the next frame from the ring, taken how many are held
+static void release_dma_frame(EGLSyncKHR *fences, int next, int *taken)
+{
+    int oldest = (next - *taken + DMA_FRAMES) % DMA_FRAMES;
+    if (fences[oldest] != EGL_NO_SYNC_KHR)
     {
-        fprintf(stderr, "Failed to read %s\n", fragment_shader_file);
-        cleanup();
-        exit(1);
+        egl_client_wait_sync(egl_display, fences[oldest], EGL_SYNC_FLUSH_COMMANDS_BIT_KHR, EGL_FOREVER_KHR);
+        egl_destroy_sync(egl_display, fences[oldest]);
     }
+    decode_ring_release(decoder_ring);
+    (*taken)--;
+}
 
-    if (runtimeconvertfile)
+// Creates dma_frames and imports each one as an external texture, so the passthrough samples decoded
+// frames where the decoder left them instead of the driver copying them out of glTexSubImage2D.
+// Returns false if the kernel or the driver can't do it
+static bool import_dma_frames(int w, int h, GLint filter)
+{
+    const char *egl_extensions = eglQueryString(egl_display, EGL_EXTENSIONS);
+    const char *gl_extensions = (const char *)glGetString(GL_EXTENSIONS);
+    if (!has_extension(egl_extensions, "EGL_EXT_image_dma_buf_import") || !has_extension(egl_extensions, "EGL_KHR_fence_sync") ||
+        !has_extension(gl_extensions, "GL_OES_EGL_image_external"))
     {
-        debprintf("Converting shadertoy shader in runtime");
-        char *converted_shader = convert_shadertoy(fragment_shader_src);
-        free(fragment_shader_src);
-        fragment_shader_src = converted_shader; // Use converted shader for compilation
+        debprintf("No EGL_EXT_image_dma_buf_import, EGL_KHR_fence_sync or GL_OES_EGL_image_external\n");
+        return false;
+    }
+    egl_create_image = (PFNEGLCREATEIMAGEKHRPROC)eglGetProcAddress("eglCreateImageKHR");
+    egl_destroy_image = (PFNEGLDESTROYIMAGEKHRPROC)eglGetProcAddress("eglDestroyImageKHR");
+    gl_image_target_texture = (PFNGLEGLIMAGETARGETTEXTURE2DOESPROC)eglGetProcAddress("glEGLImageTargetTexture2DOES");
+    egl_create_sync = (PFNEGLCREATESYNCKHRPROC)eglGetProcAddress("eglCreateSyncKHR");
+    egl_client_wait_sync = (PFNEGLCLIENTWAITSYNCKHRPROC)eglGetProcAddress("eglClientWaitSyncKHR");
+    egl_destroy_sync = (PFNEGLDESTROYSYNCKHRPROC)eglGetProcAddress("eglDestroySyncKHR");
+    if (!egl_create_image || !egl_destroy_image || !gl_image_target_texture || !egl_create_sync || !egl_client_wait_sync || !egl_destroy_sync)
+        return false;
+
+    dma_frames = dma_frames_create(w, h, DMA_FRAMES);
+    dma_images = calloc(DMA_FRAMES, sizeof(EGLImageKHR));
+    dma_textures = calloc(DMA_FRAMES, sizeof(GLuint));
+    if (!dma_frames || !dma_images || !dma_textures)
+    {
+        destroy_dma_frames();
+        return false;
     }
 
-    if (screenset == NULL)
+    for (int i = 0; i < DMA_FRAMES; i++)
+    {
+        const EGLint attribs[] = {
+            EGL_WIDTH, w,
+            EGL_HEIGHT, h,
+            EGL_LINUX_DRM_FOURCC_EXT, DMA_FORMAT_ABGR8888,
+            EGL_DMA_BUF_PLANE0_FD_EXT, dma_frames->frames[i].fd,
+            EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0,
+            EGL_DMA_BUF_PLANE0_PITCH_EXT, w * 4,
+            EGL_NONE};
+        dma_images[i] = egl_create_image(egl_display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+        if (dma_images[i] == EGL_NO_IMAGE_KHR)
+        {
+            debprintf("Driver can't import a %dx%d dma-buf frame (EGL error 0x%x)\n", w, h, eglGetError());
+            destroy_dma_frames();
+            return false;
+        }
+
+        // External textures only sample with clamping and without mipmaps
+        glGenTextures(1, &dma_textures[i]);
+        glBindTexture(GL_TEXTURE_EXTERNAL_OES, dma_textures[i]);
+        glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MIN_FILTER, filter);
+        glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MAG_FILTER, filter);
+        glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        gl_image_target_texture(GL_TEXTURE_EXTERNAL_OES, dma_images[i]);
+    }
+    if (glGetError() != GL_NO_ERROR)
+    {
+        debprintf("Failed to bind dma-buf frames to textures\n");
+        destroy_dma_frames();
+        return false;
+    }
+
+    debprintf("Sampling decoded frames in place from dma-bufs\n");
+    return true;
+}
+
+// Patches the tiles of a delta frame into the bound RGBA texture
+static void upload_delta_tiles(const struct decoded_frame *frame, int w, int h)
+{
+    static unsigned char edge_tile[DELTA_TILE_BYTES];
+    int tiles_x = delta_tiles_x(w);
+
+    for (int i = 0; i < frame->tile_count; i++)
+    {
+        int x0 = (frame->tiles[i] % tiles_x) * DELTA_TILE_SIZE;
+        int y0 = (frame->tiles[i] / tiles_x) * DELTA_TILE_SIZE;
+        int tw = w - x0 < DELTA_TILE_SIZE ? w - x0 : DELTA_TILE_SIZE;
+        int th = h - y0 < DELTA_TILE_SIZE ? h - y0 : DELTA_TILE_SIZE;
+        const unsigned char *tile = frame->pixels + (size_t)i * DELTA_TILE_BYTES;
+
+        // GLES2 has no unpack row length, so narrow edge tiles need their rows packed tight
+        if (tw < DELTA_TILE_SIZE)
+        {
+            for (int y = 0; y < th; y++)
+                memcpy(edge_tile + (size_t)y * tw * 4, tile + (size_t)y * DELTA_TILE_SIZE * 4, (size_t)tw * 4);
+            tile = edge_tile;
+        }
+        glTexSubImage2D(GL_TEXTURE_2D, 0, x0, y0, tw, th, GL_RGBA, GL_UNSIGNED_BYTE, tile);
+    }
+}
+
+static double monotonic_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void frame_done(void *data, struct wl_callback *callback, uint32_t time)
+{
+    struct display_output *output = data;
+    wl_callback_destroy(callback);
+    if (output->frame_callback == callback)
+        output->frame_callback = NULL;
+}
+
+static const struct wl_callback_listener frame_listener = {
+    .done = frame_done,
+};
+
+// Asks the compositor to say when it wants the frame after the next commit, call before committing
+// (eglSwapBuffers commits too)
+static void request_frame(void)
+{
+    // Only the newest request matters, one still pending from the cache build is dropped
+    if (target_display->frame_callback)
+        wl_callback_destroy(target_display->frame_callback);
+    target_display->frame_callback = wl_surface_frame(render_surface);
+    wl_callback_add_listener(target_display->frame_callback, &frame_listener, target_display);
+}
+
+// Frame n is due start + n / fps seconds after playback started, on CLOCK_MONOTONIC. Deadlines are
+// absolute, so the time frames take never adds up to drift
+struct frame_clock
+{
+    int64_t start; // ns
+    int fps;
+    long frame; // Last frame let through
+};
+
+static int64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Frame 0 is due right away
+static void frame_clock_start(struct frame_clock *clk, int fps)
+{
+    clk->start = monotonic_ns();
+    clk->fps = fps;
+    clk->frame = 0;
+}
+
+// Sleeps in the event loop until the compositor asks for a new frame and the deadline of the next one
+// has passed, then returns the frame that is due. Frames whose deadlines were missed are dropped
+// rather than played late. Returns -1 once the loop was stopped or the compositor is gone.
+// A covered surface or an output that is off gets no frame callbacks: once the callback is
+// HIDDEN_AFTER_MS late playback counts as suspended, the thread sleeps until the compositor asks
+// for frames again and time stands still in between, so the loop picks up where it stopped
+static long wait_for_frame(struct frame_clock *clk)
+{
+    long next = clk->frame + 1;
+    int64_t deadline = clk->start + (int64_t)next * 1000000000 / clk->fps;
+    int64_t hidden_at = deadline + (int64_t)HIDDEN_AFTER_MS * 1000000;
+    int64_t armed = deadline; // What the loop's timer is set to
+    bool suspended = false;
+    event_loop_set_deadline(main_loop, deadline);
+
+    int64_t now;
+    for (;;)
+    {
+        now = monotonic_ns();
+        if (now >= deadline && !target_display->frame_callback)
+            break;
+        if (now >= deadline && !suspended)
+        {
+            if (now >= hidden_at)
+            {
+                suspended = true; // Nothing left to wake up for but the compositor
+                debprintf("Surface is hidden, suspending playback at frame %ld\n", clk->frame);
+            }
+            else if (armed != hidden_at)
+            {
+                event_loop_set_deadline(main_loop, hidden_at);
+                armed = hidden_at;
+            }
+        }
+        if (event_loop_dispatch(main_loop, -1) == -1)
+            return -1;
+    }
+
+    if (suspended)
+    {
+        debprintf("Surface is shown again after %.1f s, resuming playback\n", (now - deadline) / 1e9);
+        clk->start = now - (int64_t)next * 1000000000 / clk->fps; // The next frame is due right now
+        clk->frame = next;
+        return next;
+    }
+    long due = (long)((now - clk->start) * clk->fps / 1000000000);
+    clk->frame = due > next ? due : next;
+    return clk->frame;
+}
+
+// Size the shader renders at, the cache may be smaller than the surface
+static void set_render_size(int w, int h)
+{
+    glViewport(0, 0, w, h);
+    if (resolution_loc != -1)
+        glUniform2f(resolution_loc, w, h);
+}
+
+// Offscreen framebuffer of w x h backed by a new texture in *tex
+static GLuint create_render_target(int w, int h, GLuint *tex)
+{
+    glGenTextures(1, tex);
+    glBindTexture(GL_TEXTURE_2D, *tex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    GLuint fbo;
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, *tex, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        fprintf(stderr, "Offscreen framebuffer for caching is incomplete\n");
+        cleanup();
+        exit(1);
+    }
+    return fbo;
+}
+
+// Renders every frame of the loop straight into its own texture, nothing is read back or compressed.
+// One texture per frame rather than an atlas, since an atlas would hit GL_MAX_TEXTURE_SIZE for any
+// real loop. GLES2 can't tell how much video memory is left, so frames are rendered until the loop
+// is complete or the driver reports GL_OUT_OF_MEMORY.
+// Returns 1 when the loop is in gpu_frames, 0 if it didn't fit and -1 if the compositor went away
+static int build_gpu_cache(int w, int h, GLint t_loc)
+{
+    gpu_frames = calloc(cache_length, sizeof(GLuint));
+    if (!gpu_frames)
+        return 0;
+
+    GLuint fbo;
+    glGenFramebuffers(1, &fbo);
+
+    while (glGetError() != GL_NO_ERROR)
+        ; // Only errors from the build should count below
+
+    int result = 1;
+    double last_present = 0.0;
+    double build_start = monotonic_seconds();
+    glClearColor(0, 0, 0, 1);
+
+    for (int i = 0; i < cache_length; i++)
+    {
+        if (event_loop_dispatch(main_loop, 0) == -1)
+        {
+            result = -1;
+            break;
+        }
+
+        glActiveTexture(GL_TEXTURE0);
+        gpu_frames[i] = create_cache_texture(GL_RGBA, w, h, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, gpu_frames[i], 0);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        {
+            debprintf("Frame texture %d can't be rendered to\n", i);
+            result = 0;
+            break;
+        }
+
+        global_time = i * FRAME_TIME;
+        glUniform1f(t_loc, (float)global_time);
+        glClear(GL_COLOR_BUFFER_BIT);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+        double now = monotonic_seconds();
+        if (!target_display->frame_callback && now - last_present >= FRAME_TIME)
+        {
+            // Same frame again on the real surface, as long as the compositor shows it
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            glClear(GL_COLOR_BUFFER_BIT);
+            glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+            request_frame();
+            eglSwapBuffers(egl_display, egl_surface);
+            wl_display_flush(display);
+            last_present = now;
+        }
+
+        GLenum err = glGetError();
+        if (err == GL_OUT_OF_MEMORY)
+        {
+            debprintf("Ran out of video memory after %d of %d frames\n", i, cache_length);
+            result = 0;
+            break;
+        }
+        if (err != GL_NO_ERROR)
+        {
+            fprintf(stderr, "OpenGL error: 0x%x\n", err);
+            cleanup();
+            exit(1);
+        }
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &fbo);
+
+    if (result != 1)
+    {
+        glDeleteTextures(cache_length, gpu_frames); // Unused names are 0 and ignored
+        free(gpu_frames);
+        gpu_frames = NULL;
+        return result;
+    }
+
+    debprintf("Rendered %d frames (%zu MiB) into video memory in %.2f s\n", cache_length,
+              (size_t)w * h * 4 * cache_length >> 20, monotonic_seconds() - build_start);
+    return 1;
+}
+
+// Frames must be submitted in order, both deltas and the loop period depend on the frames before
+struct build_state
+{
+    // Delta caches diff every frame against the one before it
+    unsigned char *prev_frame;
+    uint32_t *dirty_tiles;
+    int tile_total;
+
+    // Content hash of every frame submitted so far
+    uint64_t *hashes;
+    bool dedup; // Identical frames share data, never for delta caches since each delta depends on its predecessor
+
+    // Smallest shift that repeats every frame so far from the start of the loop, 0 if there is none
+    int period;
+    int period_confirm; // Repeated frames needed before the build stops at the period
+    bool period_found;
+};
+
+// Whether frames p..i are all repeats of frames 0..i-p
+static bool period_matches(const uint64_t *hashes, int p, int i)
+{
+    for (int j = p; j <= i; j++)
+    {
+        if (hashes[j] != hashes[j - p])
+            return false;
+    }
+    return true;
+}
+
+static void track_period(struct build_state *state, int i)
+{
+    if (i == 0 || state->period_found)
+        return;
+
+    // Every shift below the current one has already failed, only later ones can still match
+    if (state->period == 0 || state->hashes[i] != state->hashes[i - state->period])
+    {
+        int p = state->period > 0 ? state->period + 1 : i;
+        state->period = 0;
+        for (; p <= i; p++)
+        {
+            if (period_matches(state->hashes, p, i))
+            {
+                state->period = p;
+                break;
+            }
+        }
+    }
+
+    // Stopping early needs a period with at least two distinct frames that has fully repeated twice,
+    // over at least period_confirm frames. A period of 1 only says the shader sat still so far, which a
+    // slow, stepped animation does for seconds at a time, so it is only trusted once the build is over
+    int needed = 2 * state->period > state->period_confirm ? 2 * state->period : state->period_confirm;
+    if (state->period >= 2 && i - state->period + 1 >= needed)
+    {
+        state->period_found = true;
+        debprintf("Loop repeats every %d frames, stopping the cache there\n", state->period);
+    }
+}
+
+// Hands a frame that was read back into a pool buffer over to the encoders
+static void submit_cache_frame(unsigned char *raw, int i, int w, int h, struct build_state *state)
+{
+    state->hashes[i] = frame_hash(raw, (size_t)w * h * 4);
+    track_period(state, i);
+
+    // Frames still in flight when the period was confirmed are past the end of the loop
+    if (state->period_found && i >= state->period)
+    {
+        encode_pool_discard(encoder_pool, raw);
+        return;
+    }
+
+    // Matching hashes are taken as identical frames without comparing pixels, the earlier frame's
+    // pixels are gone by now and keeping them would cost as much memory as the cache saves. A collision
+    // would show the wrong frame (and be saved with the cache), but at about n^2 / 2^65 for n frames
+    // that is around 1e-12 even for a 10000 frame loop
+    if (state->dedup)
+    {
+        for (int k = 0; k < i; k++)
+        {
+            if (state->hashes[k] == state->hashes[i])
+            {
+                frame_cache[i].source = frame_cache[k].source;
+                encode_pool_discard(encoder_pool, raw);
+                return;
+            }
+        }
+    }
+
+    int tile_count = -1; // Keyframe
+    if (state->prev_frame && i > 0)
+    {
+        tile_count = delta_find_dirty_tiles(state->prev_frame, raw, w, h, state->dirty_tiles);
+
+        // Past half the frame a keyframe compresses better than the tile strip
+        if (tile_count * 2 > state->tile_total || tile_count > DELTA_MAX_TILES)
+            tile_count = -1;
+    }
+    if (state->prev_frame)
+    {
+        memcpy(state->prev_frame, raw, (size_t)w * h * 4);
+    }
+    encode_pool_submit(encoder_pool, raw, i, state->dirty_tiles, tile_count);
+}
+
+// A pixel pack buffer that a frame is being read back into without stalling the pipeline
+struct readback
+{
+    GLuint pbo;
+    GLsync fence;
+    int frame; // -1 when idle
+};
+
+// Queues an asynchronous read of the bound framebuffer, glReadPixels returns right away with a PBO bound
+static void start_readback(struct readback *rb, int frame, int w, int h)
+{
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, rb->pbo);
+    glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    rb->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    rb->frame = frame;
+}
+
+// Waits for a queued read to land and copies it into a pool buffer for the encoders
+static void finish_readback(struct readback *rb, int w, int h, struct build_state *state)
+{
+    // Normally already signalled, the GPU has been busy with the frames after this one
+    while (glClientWaitSync(rb->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+        ;
+    glDeleteSync(rb->fence);
+    rb->fence = 0;
+
+    size_t size = (size_t)w * h * 4;
+    unsigned char *raw = encode_pool_acquire(encoder_pool);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, rb->pbo);
+    const void *pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+    if (!pixels)
+    {
+        fprintf(stderr, "Failed to map the readback buffer\n");
+        cleanup();
+        exit(1);
+    }
+    memcpy(raw, pixels, size);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    submit_cache_frame(raw, rb->frame, w, h, state);
+    rb->frame = -1;
+}
+
+// Picks how the cache gets encoded so the whole loop fits in budget bytes. A few frames sampled over
+// the loop are trial encoded at falling quality, and once quality can't drop any further without going
+// below BUDGET_TARGET_SSIM the cache size is halved instead. The estimate assumes every frame gets
+// stored, duplicates and deltas only make the real cache smaller.
+// format comes in as the surface size and the requested quality, and holds the choice on return
+static void fit_cache_budget(GLint t_loc, const struct frame_codec_ops *codec, size_t budget, struct cache_format *format)
+{
+    int w = format->width;
+    int h = format->height;
+    unsigned char *sample = malloc((size_t)w * h * 4);
+    unsigned char *decoded = malloc((size_t)w * h * 4);
+    struct frame_codec *trial = frame_codec_create(codec);
+    if (!sample || !decoded || !trial)
+    {
+        fprintf(stderr, "Failed to allocate the cache budget trial\n");
+        cleanup();
+        exit(1);
+    }
+
+    // Codecs without a quality setting only have the one
+    int qualities[BUDGET_MAX_QUALITIES];
+    int quality_count = 0;
+    for (int q = format->quality; quality_count < BUDGET_MAX_QUALITIES; q -= 10)
+    {
+        qualities[quality_count++] = q;
+        if (!codec->has_quality || q - 10 < BUDGET_MIN_QUALITY)
+            break;
+    }
+
+    struct cache_format best = {0};
+    struct cache_format fallback = {0}; // Fits, but only below the target SSIM
+    struct cache_format smallest = *format;
+    glClearColor(0, 0, 0, 1);
+
+    for (int scale = 1; !best.width && w / scale >= BUDGET_MIN_SIZE && h / scale >= BUDGET_MIN_SIZE; scale *= 2)
+    {
+        int cw = w / scale;
+        int ch = h / scale;
+        GLuint fbo_tex;
+        GLuint fbo = create_render_target(cw, ch, &fbo_tex);
+        set_render_size(cw, ch);
+
+        size_t sizes[BUDGET_MAX_QUALITIES] = {0};
+        double ssim[BUDGET_MAX_QUALITIES];
+        for (int q = 0; q < quality_count; q++)
+            ssim[q] = 1.0;
+
+        for (int n = 0; n < BUDGET_SAMPLE_FRAMES; n++)
+        {
+            int i = (int)((long long)cache_length * n / BUDGET_SAMPLE_FRAMES);
+            glUniform1f(t_loc, (float)(i * FRAME_TIME));
+            glClear(GL_COLOR_BUFFER_BIT);
+            glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+            glReadPixels(0, 0, cw, ch, GL_RGBA, GL_UNSIGNED_BYTE, sample);
+
+            for (int q = 0; q < quality_count; q++)
+            {
+                size_t size;
+                const unsigned char *data = frame_codec_encode(trial, sample, cw, ch, qualities[q], &size);
+                if (!data || frame_codec_decode(trial, data, size, cw, ch, decoded) != 0)
+                {
+                    fprintf(stderr, "Cache budget trial encode failed\n");
+                    cleanup();
+                    exit(1);
+                }
+                sizes[q] += size;
+
+                // The worst sample counts, a loop is only as good as its ugliest frame
+                double s = codec->lossy ? frame_ssim(sample, decoded, cw, ch) : 1.0;
+                if (s < ssim[q])
+                    ssim[q] = s;
+            }
+        }
+
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glDeleteFramebuffers(1, &fbo);
+        glDeleteTextures(1, &fbo_tex);
+
+        for (int q = 0; q < quality_count; q++)
+        {
+            size_t estimate = sizes[q] / BUDGET_SAMPLE_FRAMES * (size_t)cache_length;
+            struct cache_format option = {cw, ch, qualities[q]};
+            debprintf("Cache trial %dx%d quality %d: ~%zu MiB, SSIM %.4f\n", cw, ch, qualities[q], estimate >> 20, ssim[q]);
+            smallest = option;
+
+            if (estimate <= budget && ssim[q] >= BUDGET_TARGET_SSIM)
+            {
+                best = option;
+                break;
+            }
+            if (estimate <= budget && !fallback.width)
+                fallback = option;
+            if (ssim[q] < BUDGET_TARGET_SSIM)
+                break; // Lower quality only gets worse, try a smaller size
+        }
+    }
+
+    set_render_size(w, h);
+    frame_codec_destroy(trial);
+    free(sample);
+    free(decoded);
+
+    if (best.width)
+    {
+        *format = best;
+    }
+    else if (fallback.width)
+    {
+        debprintf("Nothing within the budget keeps SSIM %.2f, caching below it\n", BUDGET_TARGET_SSIM);
+        *format = fallback;
+    }
+    else
+    {
+        fprintf(stderr, "Warning: the cache won't fit in --cache-mem, using the smallest size and quality tried\n");
+        *format = smallest;
+    }
+    debprintf("Caching at %dx%d with quality %d to fit %zu MiB\n", format->width, format->height, format->quality, budget >> 20);
+}
+
+// Renders the whole loop into an offscreen framebuffer as fast as the GPU and encoders allow.
+// Frames use a fixed time step instead of the wall clock, and the visible surface only gets
+// a live frame about once per FRAME_TIME so the desktop doesn't sit empty meanwhile.
+// On GLES3 frames are read back through a ring of PBOs, so the GPU keeps rendering the next
+// READBACK_DEPTH frames while the CPU copies out and encodes the current one.
+// Identical frames are stored once, and the build stops early once the loop is seen repeating,
+// shrinking cache_length to the detected period.
+// w x h is the size frames are cached at, which a memory budget may have made smaller than the surface.
+// Returns false if the compositor connection was lost before every frame was rendered
+static bool build_cache(int w, int h, GLint t_loc, const char *cache_path, const struct cache_key *cache_key,
+                        const struct cache_format *format)
+{
+    GLuint fbo_tex;
+    GLuint fbo = create_render_target(w, h, &fbo_tex);
+    set_render_size(w, h);
+
+    struct build_state state = {0};
+    state.tile_total = delta_tile_count(w, h);
+    state.dedup = !cache_key->delta;
+    state.period_confirm = 2 * cache_key->fps; // Two seconds of repeats
+    state.hashes = malloc((size_t)cache_length * sizeof(uint64_t));
+    if (!state.hashes)
+    {
+        fprintf(stderr, "Failed to allocate frame hashes\n");
+        cleanup();
+        exit(1);
+    }
+    if (cache_key->delta)
+    {
+        state.prev_frame = malloc((size_t)w * h * 4);
+        state.dirty_tiles = malloc((size_t)state.tile_total * sizeof(uint32_t));
+        if (!state.prev_frame || !state.dirty_tiles)
+        {
+            fprintf(stderr, "Failed to allocate delta frame buffers\n");
+            cleanup();
+            exit(1);
+        }
+    }
+
+    struct readback readback[READBACK_DEPTH];
+    if (gles3)
+    {
+        for (int i = 0; i < READBACK_DEPTH; i++)
+        {
+            glGenBuffers(1, &readback[i].pbo);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, readback[i].pbo);
+            glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)w * h * 4, NULL, GL_STREAM_READ);
+            readback[i].fence = 0;
+            readback[i].frame = -1;
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        debprintf("Reading cache frames back through %d pixel buffers\n", READBACK_DEPTH);
+    }
+
+    bool complete = true;
+    double last_present = 0.0;
+    double build_start = monotonic_seconds();
+    glClearColor(0, 0, 0, 1);
+
+    for (int i = 0; i < cache_length; i++)
+    {
+        if (main_loop && event_loop_dispatch(main_loop, 0) == -1)
+        {
+            complete = false;
+            break;
+        }
+        if (state.period_found)
+            break;
+
+        global_time = i * FRAME_TIME;
+        glUniform1f(t_loc, (float)global_time);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glClear(GL_COLOR_BUFFER_BIT);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+        if (gles3)
+        {
+            // The oldest read in the ring is frame i - READBACK_DEPTH, long finished by now
+            struct readback *rb = &readback[i % READBACK_DEPTH];
+            if (rb->frame >= 0)
+                finish_readback(rb, w, h, &state);
+            start_readback(rb, i, w, h);
+        }
+        else
+        {
+            // Blocks while every pool buffer is queued, so the encoders set the pace here
+            unsigned char *raw = encode_pool_acquire(encoder_pool);
+            glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, raw);
+            submit_cache_frame(raw, i, w, h, &state);
+        }
+
+        double now = monotonic_seconds();
+        if (display && !target_display->frame_callback && now - last_present >= FRAME_TIME)
+        {
+            // Same frame again on the real surface, as long as the compositor shows it
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            set_render_size(target_display->width, target_display->height);
+            glClear(GL_COLOR_BUFFER_BIT);
+            glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+            request_frame();
+            eglSwapBuffers(egl_display, egl_surface);
+            wl_display_flush(display);
+            set_render_size(w, h);
+            last_present = now;
+        }
+
+        GLenum err = glGetError();
+        if (err != GL_NO_ERROR)
+        {
+            fprintf(stderr, "OpenGL error: 0x%x\n", err);
+            cleanup();
+            exit(1);
+        }
+    }
+
+    if (gles3)
+    {
+        // Drain the ring oldest first, delta frames depend on the order
+        for (int n = 0; n < READBACK_DEPTH; n++)
+        {
+            struct readback *rb = NULL;
+            for (int j = 0; j < READBACK_DEPTH; j++)
+            {
+                if (readback[j].frame >= 0 && (!rb || readback[j].frame < rb->frame))
+                    rb = &readback[j];
+            }
+            if (rb)
+                finish_readback(rb, w, h, &state);
+        }
+        for (int i = 0; i < READBACK_DEPTH; i++)
+            glDeleteBuffers(1, &readback[i].pbo);
+    }
+
+    free(state.prev_frame);
+    free(state.dirty_tiles);
+    free(state.hashes);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteTextures(1, &fbo_tex);
+    if (target_display)
+    {
+        set_render_size(target_display->width, target_display->height);
+    }
+
+    debprintf("Finished rendering cache frames in %.2f s, waiting for encoders\n", monotonic_seconds() - build_start);
+    if (encode_pool_finish(encoder_pool) != 0)
+    {
+        fprintf(stderr, "Cache frame compression failed\n");
+        cleanup();
+        exit(1);
+    }
+    encode_pool_destroy(encoder_pool);
+    encoder_pool = NULL;
+
+    int unique = 0;
+    for (int i = 0; i < cache_length; i++)
+    {
+        if (frame_cache[i].source == i)
+        {
+            unique++;
+            continue;
+        }
+        frame_cache[i].data = frame_cache[frame_cache[i].source].data;
+        frame_cache[i].size = frame_cache[frame_cache[i].source].size;
+    }
+
+    // A period that held up to the last frame is just as good as a confirmed one
+    if (complete && state.period > 0 && state.period < cache_length)
+    {
+        for (int i = state.period; i < cache_length; i++)
+        {
+            if (frame_cache[i].source == i)
+                unique--;
+            frame_cache[i].data = NULL; // Left in the arena until exit
+        }
+        debprintf("Looping every %d frames instead of %d\n", state.period, cache_length);
+        cache_length = state.period;
+    }
+    debprintf("%d of %d cached frames are unique\n", unique, cache_length);
+
+    if (cache_key->mem_budget > 0)
+    {
+        size_t stored = 0;
+        for (int i = 0; i < cache_length; i++)
+        {
+            if (frame_cache[i].source == i)
+                stored += frame_cache[i].size;
+        }
+        debprintf("Cache takes %.1f of its %d MiB budget\n", stored / (1024.0 * 1024.0), cache_key->mem_budget);
+    }
+
+    // Never persist a partial loop
+    if (complete && cache_path[0])
+    {
+        cache_file_save(cache_path, cache_key, format, frame_cache, cache_length);
+    }
+
+    debprintf("Finished caching frames\n");
+    return complete;
+}
+
+// Gives up the GL context and the EGL surface once the cache is built and nothing renders anymore
+static void destroy_egl(void)
+{
+    glDeleteProgram(shader_program);
+    glDeleteBuffers(1, &vbo);
+    vbo = 0;
+
+    eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroySurface(egl_display, egl_surface);
+    eglDestroyContext(egl_display, egl_context);
+    eglTerminate(egl_display);
+    wl_egl_window_destroy(egl_win);
+
+    egl_win = NULL;
+    egl_surface = EGL_NO_SURFACE;
+    egl_context = EGL_NO_CONTEXT;
+    egl_display = EGL_NO_DISPLAY;
+    debprintf("Released the EGL context\n");
+}
+
+// Plays the cache back without GL: frames are decoded straight into wl_shm buffers that get attached
+// to the surface as they are, so the only GPU work left is the compositor's own. The compositor can
+// hold on to several buffers at once, the decoder gets them back oldest first once released.
+// Returns when the compositor goes away
+static void play_cache_shm(int w, int h, int fps, const struct frame_codec_ops *codec, int threads)
+{
+    shm_frames = shm_frames_create(render_shm, w, h, SHM_FRAMES, WL_SHM_FORMAT_XBGR8888);
+    if (!shm_frames)
+    {
+        fprintf(stderr, "Failed to create shared memory frames\n");
+        cleanup();
+        exit(1);
+    }
+
+    unsigned char *buffers[SHM_FRAMES];
+    for (int i = 0; i < SHM_FRAMES; i++)
+        buffers[i] = shm_frames->frames[i].data;
+    decoder_ring = decode_ring_create_into(SHM_FRAMES, w, h, codec, threads, buffers, frame_cache, cache_length);
+    if (!decoder_ring)
+    {
+        fprintf(stderr, "Failed to start decoder thread\n");
+        cleanup();
+        exit(1);
+    }
+
+    destroy_egl();
+
+    // Cached frames are bottom row first as glReadPixels left them, the compositor flips them back
+    wl_surface_set_buffer_transform(surface, WL_OUTPUT_TRANSFORM_FLIPPED_180);
+
+    debprintf("Entering shared memory cache loop\n");
+
+    int oldest = 0; // Buffer of the oldest frame taken from the ring
+    int taken = 0;  // Frames taken from the ring and not given back yet
+    struct frame_clock clk;
+    frame_clock_start(&clk, fps);
+    for (;;)
+    {
+        // Slots go back to the ring in order, a buffer released early waits for the ones before it
+        while (taken > 0 && !shm_frames->frames[oldest].busy)
+        {
+            decode_ring_release(decoder_ring);
+            oldest = (oldest + 1) % SHM_FRAMES;
+            taken--;
+        }
+        if (taken == SHM_FRAMES)
+        {
+            // Every buffer is on screen or queued at the compositor, block until one comes back
+            if (event_loop_dispatch(main_loop, -1) == -1)
+                break;
+            continue;
+        }
+
+        const struct decoded_frame *frame = decode_ring_next(decoder_ring);
+        struct shm_frame *buffer = &shm_frames->frames[(oldest + taken) % SHM_FRAMES];
+        taken++;
+        int due_frame = (int)(clk.frame % cache_length);
+        if (frame->frame_idx != due_frame)
+        {
+            // Behind the clock, the buffer goes back without being shown
+            decode_ring_seek(decoder_ring, due_frame);
+            continue;
+        }
+        if (frame->pixels)
+        {
+            buffer->busy = 1;
+            wl_surface_attach(surface, buffer->buffer, 0, 0);
+            wl_surface_damage_buffer(surface, 0, 0, w, h);
+            request_frame();
+            wl_surface_commit(surface);
+        }
+
+        // Without a commit no callback is coming, a failed frame just takes its time slot
+        if (wait_for_frame(&clk) < 0)
+            break;
+    }
+}
+
+// Renders the loop once per resolution in sizes ("1920x1080,3840x2160") on an offscreen context and
+// writes the tracks with the shader into a bundle at path. key holds everything but the resolution.
+// Returns the exit status
+static int bake_bundle(const char *path, const char *sizes, const char *source, const char *shader_src, const struct cache_key *key,
+                       const struct frame_codec_ops *codec, int hugepages)
+{
+    int max_tracks = 1;
+    for (const char *p = sizes; *p; p++)
+        max_tracks += *p == ',';
+
+    struct baked_track
+    {
+        struct cache_key key;
+        struct cache_format format;
+        struct cached_frame *frames;
+        int frame_count;
+        struct frame_arena *arena;
+    } *baked = calloc(max_tracks, sizeof(struct baked_track));
+    struct bundle_track *tracks = calloc(max_tracks, sizeof(struct bundle_track));
+    if (!baked || !tracks)
+    {
+        fprintf(stderr, "Failed to allocate bundle tracks\n");
+        return 1;
+    }
+
+    init_egl_headless();
+    glGenBuffers(1, &vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(VERTS), VERTS, GL_STATIC_DRAW);
+    shader_program = compile_gl_program(strdup(shader_src));
+    glUseProgram(shader_program);
+    GLint pos_loc = glGetAttribLocation(shader_program, "pos");
+    glEnableVertexAttribArray(pos_loc);
+    glVertexAttribPointer(pos_loc, 2, GL_FLOAT, GL_FALSE, 0, 0);
+    GLint t_loc = glGetUniformLocation(shader_program, "time");
+    GLint mouse_loc = glGetUniformLocation(shader_program, "mouse");
+    resolution_loc = glGetUniformLocation(shader_program, "resolution");
+
+    int track_count = 0;
+    int status = 0;
+    const char *p = sizes;
+    while (*p && status == 0)
+    {
+        int w, h, n;
+        if (sscanf(p, "%dx%d%n", &w, &h, &n) != 2 || w < 1 || h < 1 || (p[n] != ',' && p[n] != '\0'))
+        {
+            fprintf(stderr, "Invalid --bake-size %s, expected WIDTHxHEIGHT[,WIDTHxHEIGHT...]\n", sizes);
+            status = 1;
+            break;
+        }
+        p += n + (p[n] == ',');
+
+        struct baked_track *track = &baked[track_count];
+        track->key = *key;
+        track->key.width = w;
+        track->key.height = h;
+        track->format = (struct cache_format){w, h, key->quality};
+        cache_length = key->fps * key->cache_seconds;
+        debprintf("Baking %dx%d\n", w, h);
+
+        // The mouse sits in the middle of the output it was baked for
+        glUniform2f(mouse_loc, w / 2, h / 2);
+        if (key->mem_budget > 0)
+        {
+            fit_cache_budget(t_loc, codec, (size_t)key->mem_budget << 20, &track->format);
+        }
+
+        // build_cache works on the globals, each track takes them over once it is done
+        frame_cache = calloc(cache_length, sizeof(struct cached_frame));
+        cache_arena = frame_arena_create(hugepages);
+        encoder_pool = frame_cache && cache_arena ? encode_pool_create(0, track->format.width, track->format.height, codec, track->format.quality,
+                                                                        key->delta, cache_arena, frame_cache)
+                                                  : NULL;
+        if (!encoder_pool)
+        {
+            fprintf(stderr, "Failed to start encoder threads\n");
+            free(frame_cache);
+            frame_arena_destroy(cache_arena);
+            frame_cache = NULL;
+            cache_arena = NULL;
+            status = 1;
+            break;
+        }
+        for (int i = 0; i < cache_length; i++)
+            frame_cache[i].source = i;
+
+        build_cache(track->format.width, track->format.height, t_loc, "", &track->key, &track->format);
+        track->frames = frame_cache;
+        track->frame_count = cache_length;
+        track->arena = cache_arena;
+        frame_cache = NULL;
+        cache_arena = NULL;
+
+        tracks[track_count].key = &track->key;
+        tracks[track_count].format = &track->format;
+        tracks[track_count].frames = track->frames;
+        tracks[track_count].frame_count = track->frame_count;
+        track_count++;
+    }
+
+    if (status == 0 && bundle_write(path, source, shader_src, key->fps, key->cache_seconds, tracks, track_count) != 0)
+        status = 1;
+    if (status == 0)
+        printf("Baked %d tracks into %s\n", track_count, path);
+
+    for (int i = 0; i < track_count; i++)
+    {
+        free(baked[i].frames);
+        frame_arena_destroy(baked[i].arena);
+    }
+    free(baked);
+    free(tracks);
+    cache_length = 0; // Nothing left for cleanup to free
+    return status;
+}
+
+int main(int argc, const char **argv)
+{
+    signal(SIGINT, handle_sigint);
+
+    bool running_hyprland = false; // Using hyprctl for cursor position (for now), so must check if its hyprland or not before trying hyprctl
+
+    char *fragment_shader_file = NULL;
+    screenset = NULL;
+    char *convertfile = NULL;
+    bool runtimeconvertfile = false;
+    int fps = 60;
+
+    int cache_seconds = 0;
+    int cache_quality = 75;
+    const char *cache_codec_name = "jpeg";
+    int cache_yuv = 0;
+    int cache_delta = 0;
+    int cache_gpu = 0;
+    int cache_hugepages = 0;
+    int cache_mem = 0;
+    int cache_low_power = 0;
+    int cache_decode_threads = 1;
+    int cache_shm = 0;
+    int cache_dmabuf = 0;
+    const char *bake_path = NULL;
+    const char *bake_sizes = "1920x1080";
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_STRING('c', "convert", &convertfile, "Convert a file with a shadertoy shader and exit. (WARNING: the file will be overwritten. If you don't want it to be overwritten, please consider runtime convert option)"),
+        OPT_BOOLEAN('r', "rt-convert", &runtimeconvertfile, "Convert the shader file with shadertoy shader in runtime without modifying the file"),
+        OPT_STRING('s', "shader", &fragment_shader_file, "Path to the fragment shader"),
+        OPT_STRING(0, "monitor", &screenset, "A monitor to which the shader will be rendered"), // Should be '*' or MONITOR1,MONITOR2 when multimonitor setups will be supported
+        OPT_BOOLEAN('d', "debug", &debug, "Option to get debug outputs", 0, 0),
+        OPT_INTEGER('f', "fps", &fps, "Frames per second, an upper limit on top of what the compositor asks for"),
+        OPT_INTEGER(0, "cache", &cache_seconds, "Amount of seconds for caching (looping). Useful when you dont want to compute the shader over and over."),
+        OPT_STRING(0, "cache-codec", &cache_codec_name, "Codec for cached frames: jpeg (lossy, smallest), qoi (lossless, fast for flat colors and gradients), etc2 (GPU compressed texture, uploaded without decoding on GLES3) or raw (uncompressed) (default jpeg)"),
+        OPT_INTEGER(0, "cache-quality", &cache_quality, "Caching quality (JPEG compression quality) 10-100 (default 75)"),
+        OPT_BOOLEAN(0, "cache-delta", &cache_delta, "Store only the parts of each cached frame that changed and upload only those (for mostly static shaders)"),
+        OPT_BOOLEAN(0, "cache-gpu", &cache_gpu, "Keep the whole cached loop as textures in video memory, for short loops (falls back to the compressed cache if it doesn't fit)"),
+        OPT_BOOLEAN(0, "cache-hugepages", &cache_hugepages, "Back the frame cache with transparent huge pages (fewer TLB misses during playback)"),
+        OPT_INTEGER(0, "cache-mem", &cache_mem, "Memory budget for the cache in MiB, quality and then resolution are lowered until the loop fits (default no budget)"),
+        OPT_BOOLEAN(0, "cache-low-power", &cache_low_power, "Decode cached frames at 1/2, 1/4 or 1/8 resolution whenever decoding can't keep up and let the GPU upscale them (jpeg only)"),
+        OPT_INTEGER(0, "cache-decode-threads", &cache_decode_threads, "Threads decoding each cached frame in slices, for 4K and larger outputs (jpeg caches at least 1080 rows tall, 0 for one per cpu, default 1)"),
+        OPT_BOOLEAN(0, "cache-dmabuf", &cache_dmabuf, "Decode cached frames into dma-bufs the GPU samples in place instead of uploading them (needs /dev/udmabuf, RGBA caches only)"),
+        OPT_BOOLEAN(0, "cache-shm", &cache_shm, "Play the cache back through shared memory buffers and release the GL context once it is built (full size RGBA caches only)"),
+        OPT_STRING(0, "bake", &bake_path, "Render the cached loop without a compositor and write it with the shader into a .vpk bundle that --shader can play as it is, then exit"),
+        OPT_STRING(0, "bake-size", &bake_sizes, "Resolutions to bake, one track each, comma separated (default 1920x1080)"),
+        OPT_BOOLEAN(0, "cache-yuv", &cache_yuv, "Play the cache back from YUV planes and convert colors on the GPU (less CPU and upload bandwidth)"),
+        OPT_END(),
+    };
+    struct argparse argparse;
+    argparse_init(&argparse, options, NULL, 0);
+    argparse_parse(&argparse, argc, argv);
+
+    debprintf("Running in debug mode\n");
+
+    const char *hypr = getenv("HYPRLAND_INSTANCE_SIGNATURE");
+
+    if (hypr)
+    {
+        debprintf("Running hyprland\n");
+        running_hyprland = true;
+    }
+    else
+    {
+        debprintf("Not running under Hyprland.\n");
+    }
+
+    if (convertfile && runtimeconvertfile)
+    {
+        fprintf(stderr, "The file should be either converted at runtime or with file modifiying. Specify either convert or either runtimeconvert file, not both\n");
+        cleanup();
+        exit(1);
+    }
+
+    if (convertfile != NULL)
+    {
+        // Read the input shader
+        char *shader_src = read_file(convertfile);
+        if (!shader_src)
+        {
+            fprintf(stderr, "Failed to read %s\n", convertfile);
+            exit(1);
+        }
+
+        // Convert the shader
+        char *converted_shader = convert_shadertoy(shader_src);
+        free(shader_src); // free original buffer
+        if (!converted_shader)
+        {
+            fprintf(stderr, "Failed to convert shader.\n");
+            cleanup();
+            exit(1);
+        }
+
+        // Overwrite the file with converted shader
+        FILE *f = fopen(convertfile, "w");
+        if (!f)
+        {
+            fprintf(stderr, "Failed to open %s for writing\n", convertfile);
+            free(converted_shader);
+            cleanup();
+            exit(1);
+        }
+        fputs(converted_shader, f);
+        fclose(f);
+        free(converted_shader);
+
+        printf("Shader converted and saved to %s\n", convertfile);
+
+        cleanup();
+        exit(0); // Exit after overwriting
+    }
+
+    if (fragment_shader_file == NULL)
+    {
+        fprintf(stderr, "Shader file was not specified\n");
+        exit(1);
+    }
+
+    debprintf("Reading %s\n", fragment_shader_file);
+    wallpaper_bundle = bundle_open(fragment_shader_file);
+    char *fragment_shader_src = wallpaper_bundle ? strdup(bundle_get_info(wallpaper_bundle)->shader) : read_file(fragment_shader_file);
+    if (!fragment_shader_src)
+    {
+        fprintf(stderr, "Failed to read %s\n", fragment_shader_file);
+        cleanup();
+        exit(1);
+    }
+
+    if (wallpaper_bundle && bundle_get_info(wallpaper_bundle)->track_count > 0)
+    {
+        // Baked loops only play back at the rate and length they were rendered at
+        fps = bundle_get_info(wallpaper_bundle)->fps;
+        cache_seconds = bundle_get_info(wallpaper_bundle)->cache_seconds;
+    }
+
+    if (runtimeconvertfile && !wallpaper_bundle) // Bundles hold the converted source
+    {
+        debprintf("Converting shadertoy shader in runtime");
+        char *converted_shader = convert_shadertoy(fragment_shader_src);
+        free(fragment_shader_src);
+        fragment_shader_src = converted_shader; // Use converted shader for compilation
+    }
+
+    // The cache file is keyed by the source that actually gets compiled
+    uint64_t shader_hash = cache_hash(CACHE_HASH_INIT, fragment_shader_src, strlen(fragment_shader_src));
+
+    if (screenset == NULL)
     {
         printf("No monitor specified, will be picking the last one\n");
     }
@@ -1004,6 +2256,31 @@ int main(int argc, const char **argv)
         exit(1);
     }
 
+    const struct frame_codec_ops *cache_codec = frame_codec_find(cache_codec_name);
+    if (!cache_codec)
+    {
+        fprintf(stderr, "Unknown cache codec %s, expected one of:", cache_codec_name);
+        for (size_t i = 0; frame_codec_at(i); i++)
+            fprintf(stderr, " %s", frame_codec_at(i)->name);
+        fprintf(stderr, "\n");
+        cleanup();
+        exit(1);
+    }
+    if (cache_yuv && !cache_codec->decode_yuv)
+    {
+        fprintf(stderr, "--cache-yuv needs a codec that stores YUV, like jpeg\n");
+        cleanup();
+        exit(1);
+    }
+
+    if (cache_yuv && cache_delta)
+    {
+        // Delta tiles are patched into an RGBA texture, there are no YUV planes to patch
+        fprintf(stderr, "--cache-yuv can't be combined with --cache-delta\n");
+        cleanup();
+        exit(1);
+    }
+
     FRAME_TIME = 1.0 / (double)fps;
     if (cache_seconds > 0)
     {
@@ -1012,15 +2289,67 @@ int main(int argc, const char **argv)
         debprintf("%d cache length\n", cache_length);
     }
     wl_list_init(&outputs);
+
+    if (bake_path)
+    {
+        if (cache_length <= 0)
+        {
+            fprintf(stderr, "--bake needs the loop length from --cache\n");
+            cleanup();
+            exit(1);
+        }
+        // Bundles store the shader as written next to what gets compiled
+        char *written_src = wallpaper_bundle ? strdup(bundle_get_info(wallpaper_bundle)->source) : read_file(fragment_shader_file);
+        struct cache_key bake_key = {0};
+        bake_key.shader_hash = shader_hash;
+        bake_key.fps = fps;
+        bake_key.cache_seconds = cache_seconds;
+        bake_key.codec = cache_codec->id;
+        bake_key.quality = cache_codec->has_quality ? cache_quality : 0;
+        bake_key.delta = cache_delta;
+        bake_key.mem_budget = cache_mem;
+        int ret = bake_bundle(bake_path, bake_sizes, written_src ? written_src : fragment_shader_src, fragment_shader_src, &bake_key,
+                              cache_codec, cache_hugepages);
+        free(written_src);
+        free(fragment_shader_src);
+        cleanup();
+        return ret;
+    }
+
     struct wl_state state = {0};
     state.monitor = screenset ? strdup(screenset) : strdup("*"); // default to all
     state.surface_layer = ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND;
     display = wl_display_connect(NULL);
+    if (!display)
+    {
+        fprintf(stderr, "Failed to connect to the Wayland display\n");
+        cleanup();
+        exit(1);
+    }
+    // Before any thread is started, so only the loop gets the signals
+    render_queue = wl_display_create_queue(display);
+    main_loop = render_queue ? event_loop_create(display, render_queue) : NULL;
+    wayland_messages = message_queue_create(WAYLAND_MESSAGES);
+    if (!main_loop || !wayland_messages || event_loop_add_signal(main_loop, SIGINT, stop_event_loop, NULL) != 0 ||
+        event_loop_add_signal(main_loop, SIGTERM, stop_event_loop, NULL) != 0 ||
+        event_loop_add_fd(main_loop, message_queue_fd(wayland_messages), EPOLLIN, handle_wayland_messages, NULL) != 0)
+    {
+        fprintf(stderr, "Failed to set up the event loop\n");
+        cleanup();
+        exit(1);
+    }
     registry = wl_display_get_registry(display);
     wl_registry_add_listener(registry, &registry_listener, &state);
     wl_display_roundtrip(display); // First roundtrip to get registry
     wl_display_roundtrip(display); // Second roundtrip to get output listener give monitors
     surface = wl_compositor_create_surface(compositor);
+    render_surface = wl_proxy_create_wrapper(surface);
+    wl_proxy_set_queue((struct wl_proxy *)render_surface, render_queue);
+    if (shm)
+    {
+        render_shm = wl_proxy_create_wrapper(shm);
+        wl_proxy_set_queue((struct wl_proxy *)render_shm, render_queue);
+    }
     // Setting empty input region to be passthrough
     struct wl_region *empty_region = wl_compositor_create_region(compositor);
     wl_surface_set_input_region(surface, empty_region);
@@ -1035,13 +2364,6 @@ int main(int argc, const char **argv)
     int w = target_display->width; // Should be changed after multimonitor will be supported
     int h = target_display->height;
 
-    // Allocate the frame cache into ram
-    if (cache_length > 0)
-    {
-        debprintf("Giving memory to compressed frame cache (JPEG)\n");
-        frame_cache = calloc(cache_length, sizeof(struct cached_frame));
-    }
-
     layer_surface = zwlr_layer_shell_v1_get_layer_surface(
         layer_shell, surface, target_display->wl_output, ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND, "vecpaper");
     zwlr_layer_surface_v1_add_listener(layer_surface, &layer_surface_listener, NULL);
@@ -1053,66 +2375,214 @@ int main(int argc, const char **argv)
                                          ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT);
     zwlr_layer_surface_v1_set_exclusive_zone(layer_surface, -1);
     wl_surface_commit(surface);
-    init_egl(display, surface);
-    shader_program = compile_gl_program(fragment_shader_src);
-    glUseProgram(shader_program);
+    if (!start_wayland_thread())
+    {
+        fprintf(stderr, "Failed to start the Wayland thread\n");
+        cleanup();
+        exit(1);
+    }
+
+    struct cache_key cache_key = {0};
+    struct cache_format cache_format = {w, h, cache_quality};
+    char cache_path[4096];
+    bool shared_cache = false; // frame_cache maps the copy of another instance
+    bool prebaked = false;     // frame_cache plays a track baked into the bundle, the shader is never compiled
+
+    if (wallpaper_bundle && cache_length > 0)
+    {
+        frame_cache = calloc(cache_length, sizeof(struct cached_frame));
+        if (!frame_cache)
+        {
+            fprintf(stderr, "Failed to allocate the frame cache\n");
+            cleanup();
+            exit(1);
+        }
+        int track = bundle_find_track(wallpaper_bundle, w, h);
+        if (track >= 0 && bundle_load_track(wallpaper_bundle, track, frame_cache, cache_length, &cache_length, &cache_key, &cache_format) == 0)
+        {
+            prebaked = true;
+            cache_codec = frame_codec_find_id(cache_key.codec);
+            if (!cache_codec)
+            {
+                fprintf(stderr, "The bundle was baked with a codec this build doesn't have\n");
+                cleanup();
+                exit(1);
+            }
+            cache_delta = cache_key.delta;
+            if (cache_yuv && (!cache_codec->decode_yuv || cache_delta))
+            {
+                debprintf("The bundle track can't be played back from YUV planes, ignoring --cache-yuv\n");
+                cache_yuv = 0;
+            }
+        }
+        else
+        {
+            debprintf("No track in the bundle can be played, rendering the shader\n");
+            free(frame_cache);
+            frame_cache = NULL;
+        }
+    }
+
+    init_egl(display, surface, cache_length > 0); // GLES3 only pays off for cache readback
     glGenBuffers(1, &vbo);
     glBindBuffer(GL_ARRAY_BUFFER, vbo);
     glBufferData(GL_ARRAY_BUFFER, sizeof(VERTS), VERTS, GL_STATIC_DRAW);
-    GLint pos_loc = glGetAttribLocation(shader_program, "pos");
-    glEnableVertexAttribArray(pos_loc);
-    glVertexAttribPointer(pos_loc, 2, GL_FLOAT, GL_FALSE, 0, 0);
-    GLuint t_loc = glGetUniformLocation(shader_program, "time");
-    if (t_loc == -1)
-    {
-        debprintf("Warning: 'time' uniform not found. Perhaps it is unused?\n");
-    }
-    GLuint res_loc = glGetUniformLocation(shader_program, "resolution");
-    if (res_loc == -1)
+    GLint pos_loc = -1;
+    GLuint t_loc = -1;
+    GLuint mouse_loc = -1;
+    float mouse_x, mouse_y;
+
+    mouse_x = (float)(target_display->width / 2);
+    mouse_y = (float)(target_display->height / 2);
+
+    if (!prebaked)
     {
-        debprintf("Warning: 'resolution' uniform not found. Perhaps it is unused?\n");
+        shader_program = compile_gl_program(fragment_shader_src);
+        glUseProgram(shader_program);
+        pos_loc = glGetAttribLocation(shader_program, "pos");
+        glEnableVertexAttribArray(pos_loc);
+        glVertexAttribPointer(pos_loc, 2, GL_FLOAT, GL_FALSE, 0, 0);
+        t_loc = glGetUniformLocation(shader_program, "time");
+        if (t_loc == -1)
+        {
+            debprintf("Warning: 'time' uniform not found. Perhaps it is unused?\n");
+        }
+        resolution_loc = glGetUniformLocation(shader_program, "resolution");
+        if (resolution_loc == -1)
+        {
+            debprintf("Warning: 'resolution' uniform not found. Perhaps it is unused?\n");
+        }
+        else
+        {
+            glUniform2f(resolution_loc, target_display->width, target_display->height);
+        }
+
+        mouse_loc = glGetUniformLocation(shader_program, "mouse");
+        if (mouse_loc == -1)
+        {
+            debprintf("Warning: 'mouse' uniform not found. Perhaps it is unused?\n");
+        }
+
+        glUniform2f(mouse_loc, mouse_x, mouse_y); // Setting initial position
     }
     else
     {
-        glUniform2f(res_loc, target_display->width, target_display->height);
+        free(fragment_shader_src);
     }
 
-    GLuint mouse_loc = glGetUniformLocation(shader_program, "mouse");
-    if (mouse_loc == -1)
+    if (running_hyprland)
     {
-        debprintf("Warning: 'mouse' uniform not found. Perhaps it is unused?\n");
+        get_monitor_geometry(target_display); // Get monitor offsets for Hyprland
     }
 
-    if (running_hyprland)
+    debprintf("Resolution: %dx%d\n", target_display->width, target_display->height);
+
+    // Short loops can stay on the GPU as they are rendered, skipping the CPU cache entirely
+    if (cache_length > 0 && cache_gpu && !prebaked)
     {
-        get_monitor_geometry(target_display); // Get monitor offsets for Hyprland
+        int gpu_cache = build_gpu_cache(w, h, t_loc);
+        if (gpu_cache < 0)
+        {
+            cleanup(); // Stopped or the compositor went away mid build
+            return 0;
+        }
+        if (gpu_cache == 0)
+        {
+            debprintf("Loop does not fit in video memory, falling back to the compressed cache\n");
+        }
     }
 
-    float mouse_x, mouse_y;
 
-    mouse_x = (float)(target_display->width / 2);
-    mouse_y = (float)(target_display->height / 2);
+    // Allocate the frame cache into ram
+    if (cache_length > 0 && !gpu_frames && !prebaked)
+    {
+        debprintf("Giving memory to frame cache (%s)\n", cache_codec->name);
+        frame_cache = calloc(cache_length, sizeof(struct cached_frame));
+        if (!frame_cache)
+        {
+            fprintf(stderr, "Failed to allocate the frame cache\n");
+            cleanup();
+            exit(1);
+        }
+        for (int i = 0; i < cache_length; i++)
+            frame_cache[i].source = i;
+
+        cache_key.shader_hash = shader_hash;
+        cache_key.width = w;
+        cache_key.height = h;
+        cache_key.fps = fps;
+        cache_key.cache_seconds = cache_seconds;
+        cache_key.codec = cache_codec->id;
+        cache_key.quality = cache_codec->has_quality ? cache_quality : 0; // Other codecs don't depend on it
+        cache_key.delta = cache_delta;
+        cache_key.mem_budget = cache_mem;
+        if (cache_file_path(&cache_key, cache_path, sizeof(cache_path)) != 0)
+        {
+            cache_path[0] = '\0';
+        }
 
-    glUniform2f(mouse_loc, mouse_x, mouse_y); // Setting initial position
+        // An instance on another monitor may already be playing the same loop
+        frame_cache_file = cache_share_fetch(&cache_key, frame_cache, cache_length, &cache_length, &cache_format);
+        shared_cache = frame_cache_file != NULL;
+        if (!frame_cache_file && cache_path[0])
+        {
+            frame_cache_file = cache_file_load(cache_path, &cache_key, frame_cache, cache_length, &cache_length, &cache_format);
+        }
 
-    debprintf("Resolution: %dx%d\n", target_display->width, target_display->height);
-    int current_frame = 0;
+        if (!frame_cache_file)
+        {
+            if (cache_mem > 0)
+            {
+                fit_cache_budget(t_loc, cache_codec, (size_t)cache_mem << 20, &cache_format);
+            }
 
-    // Main render loop
-    // The problem to make this multimonitor is to render only 1 frame and mirror it to each monitor, instead of rendering it each time for each monitor
-    // On the other hand if we render it for each monitor, then we shouldn't be caring about framerate or resolution being the same
-    while (wl_display_dispatch_pending(display) != -1)
+            cache_arena = frame_arena_create(cache_hugepages);
+            encoder_pool = cache_arena ? encode_pool_create(0, cache_format.width, cache_format.height, cache_codec, cache_format.quality,
+                                                            cache_delta, cache_arena, frame_cache)
+                                       : NULL;
+            if (!encoder_pool)
+            {
+                fprintf(stderr, "Failed to start encoder threads\n");
+                cleanup();
+                exit(1);
+            }
+        }
+    }
+
+    // A loaded cache file has nothing left to render
+    if (cache_length > 0 && !gpu_frames && !frame_cache_file && !prebaked &&
+        !build_cache(cache_format.width, cache_format.height, t_loc, cache_path, &cache_key, &cache_format))
+    {
+        cleanup(); // Stopped or the compositor went away mid build
+        return 0;
+    }
+
+    // Instances started later on other monitors map this copy instead of keeping their own
+    if (cache_length > 0 && !gpu_frames && !shared_cache && !prebaked)
     {
-        if (cache_length > 0 && current_frame == cache_length)
+        frame_cache_share = cache_share_publish(&cache_key, &cache_format, frame_cache, cache_length);
+        if (frame_cache_share)
         {
-            debprintf("Finished caching frames\n");
-            break; // We already cached all frames, stop render loop and start the cache loop instead
+            // frame_cache points into the shared copy now
+            cache_file_unmap(frame_cache_file);
+            frame_cache_file = NULL;
+            frame_arena_destroy(cache_arena);
+            cache_arena = NULL;
         }
+    }
 
+    // Main render loop
+    // The problem to make this multimonitor is to render only 1 frame and mirror it to each monitor, instead of rendering it each time for each monitor
+    // On the other hand if we render it for each monitor, then we shouldn't be caring about framerate or resolution being the same
+    struct frame_clock clk;
+    frame_clock_start(&clk, fps);
+    while (cache_length <= 0)
+    {
         // Set uniforms
+        global_time = (double)clk.frame / fps; // Follows the real clock, dropped frames included
         glUniform1f(t_loc, (float)global_time); // Time
 
-        if (running_hyprland && cache_length <= 0)
+        if (running_hyprland)
         {
             int cursor_x, cursor_y;
             hyprctl_get_cursor_pos(&cursor_x, &cursor_y);
@@ -1127,27 +2597,6 @@ int main(int argc, const char **argv)
         glClearColor(0, 0, 0, 1);
         glClear(GL_COLOR_BUFFER_BIT);
         glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-        if (cache_length > 0)
-        {
-            unsigned char *raw = malloc(w * h * 4); // Put the full frame in ram for now
-            glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, raw);
-
-            size_t jpeg_size;
-            unsigned char *jpeg = compress_jpeg(raw, w, h, cache_quality, &jpeg_size);
-            free(raw);
-
-            if (!jpeg)
-            {
-                fprintf(stderr, "JPEG compression failed\n");
-                cleanup();
-                exit(1);
-            }
-
-            frame_cache[current_frame].jpeg_data = jpeg;
-            frame_cache[current_frame].jpeg_size = jpeg_size;
-
-            debprintf("Cached frame %d: %zu bytes (compressed)\n", current_frame, jpeg_size);
-        }
         GLenum err = glGetError();
         if (err != GL_NO_ERROR)
         {
@@ -1155,30 +2604,83 @@ int main(int argc, const char **argv)
             cleanup();
             exit(1);
         }
+        request_frame();
         eglSwapBuffers(egl_display, egl_surface);
-        wl_display_flush(display);
-        struct timespec ts = {0, (long)(FRAME_TIME * 1e9)};
-        nanosleep(&ts, NULL);
-        global_time += FRAME_TIME; // That may cause time drifting because we dont sync with time spent on rendering
-        current_frame++;
+        if (wait_for_frame(&clk) < 0)
+            break;
+    }
+
+    if (cache_length > 0 && cache_shm)
+    {
+        // Buffers are attached unscaled and as RGBA, anything else needs the GPU
+        if (!gpu_frames && !cache_delta && !cache_yuv && cache_format.width == w && cache_format.height == h && shm && shm_xbgr)
+        {
+            if (cache_low_power)
+            {
+                debprintf("Low power playback only applies to GL playback, ignoring it\n");
+            }
+            play_cache_shm(w, h, fps, cache_codec, cache_decode_threads);
+            cleanup();
+            return 0;
+        }
+        debprintf("Shared memory playback needs a full size RGBA cache and XBGR8888 buffers, playing back through GL\n");
     }
 
     // Cache playback
     if (cache_length > 0)
     {
-        int frame_idx = 0;
-        // Create texture for playback
-        glGenTextures(1, &cache_tex);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, cache_tex);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-
-        // Compile passthrough program
-        passthrough_program = compile_gl_program(strdup(passthrough_fragment_src));
+        enum frame_format format = cache_yuv && !gpu_frames ? FRAME_YUV420 : FRAME_RGBA;
+
+        // Compressed texture frames go to the GPU exactly as they are cached, which needs GLES3 and whole frames
+        bool compressed = cache_codec->gl_format && gles3 && !cache_delta && !gpu_frames;
+        if (cache_codec->gl_format && !compressed && !gpu_frames)
+        {
+            debprintf("Decoding %s frames on the CPU, uploading them as they are needs GLES3 and no --cache-delta\n", cache_codec->name);
+        }
+
+        int cw = cache_format.width; // Smaller than the surface if it had to fit a memory budget
+        int ch = cache_format.height;
+        GLint filter = cw == w && ch == h ? GL_NEAREST : GL_LINEAR;
+        struct yuv_layout yuv;
+        jpeg_yuv_layout(cw, ch, &yuv);
+
+        // Whole RGBA frames only, delta tiles are patched into a texture that keeps the rest of the frame
+        bool dmabuf = false;
+        if (cache_dmabuf)
+        {
+            dmabuf = format == FRAME_RGBA && !cache_delta && !gpu_frames && !compressed && import_dma_frames(cw, ch, filter);
+            if (!dmabuf)
+            {
+                debprintf("Can't sample frames from dma-bufs, uploading them instead\n");
+            }
+        }
+
+        // Create textures and compile passthrough program
+        if (format == FRAME_YUV420)
+        {
+            glActiveTexture(GL_TEXTURE0);
+            cache_tex = create_cache_texture(GL_LUMINANCE, yuv.y_stride, yuv.y_rows, filter);
+            glActiveTexture(GL_TEXTURE1);
+            cache_chroma_tex[0] = create_cache_texture(GL_LUMINANCE, yuv.c_stride, yuv.c_rows, GL_LINEAR);
+            glActiveTexture(GL_TEXTURE2);
+            cache_chroma_tex[1] = create_cache_texture(GL_LUMINANCE, yuv.c_stride, yuv.c_rows, GL_LINEAR);
+
+            passthrough_program = compile_gl_program(strdup(yuv_fragment_src));
+        }
+        else
+        {
+            glActiveTexture(GL_TEXTURE0);
+            if (compressed)
+            {
+                cache_tex = create_compressed_cache_texture(cache_codec->gl_format, cw, ch, filter, &frame_cache[0]);
+            }
+            else if (!gpu_frames && !dmabuf)
+            {
+                cache_tex = create_cache_texture(GL_RGBA, cw, ch, filter);
+            }
+
+            passthrough_program = compile_gl_program(strdup(dmabuf ? external_fragment_src : passthrough_fragment_src));
+        }
         glUseProgram(passthrough_program);
 
         // Rebind vertex attribs for new program
@@ -1186,36 +2688,178 @@ int main(int argc, const char **argv)
         glEnableVertexAttribArray(pos_loc);
         glVertexAttribPointer(pos_loc, 2, GL_FLOAT, GL_FALSE, 0, 0);
 
-        // Bind texture uniform
-        GLint tex_loc = glGetUniformLocation(passthrough_program, "tex");
-
-        if (tex_loc != -1)
+        // Bind texture uniforms
+        if (format == FRAME_YUV420)
         {
-            glUniform1i(tex_loc, 0);
+            glUniform1i(glGetUniformLocation(passthrough_program, "tex_y"), 0);
+            glUniform1i(glGetUniformLocation(passthrough_program, "tex_cb"), 1);
+            glUniform1i(glGetUniformLocation(passthrough_program, "tex_cr"), 2);
+            glUniform2f(glGetUniformLocation(passthrough_program, "uv_scale"),
+                        (float)cw / yuv.y_stride, (float)ch / yuv.y_rows);
         }
+        else
+        {
+            GLint tex_loc = glGetUniformLocation(passthrough_program, "tex");
 
-        debprintf("Entering cache render loop (passthrough shader)\n");
+            if (tex_loc != -1)
+            {
+                glUniform1i(tex_loc, 0);
+            }
+        }
 
-        while (wl_display_dispatch_pending(display) != -1)
+        // Decode frames ahead of playback on a separate thread
+        if (dmabuf)
         {
-            // Upload current cached frame
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, cache_tex);
-
-            // Decompress on the fly
-            unsigned char *rgba = decompress_jpeg(
-                frame_cache[frame_idx].jpeg_data,
-                frame_cache[frame_idx].jpeg_size,
-                w, h);
+            unsigned char *buffers[DMA_FRAMES];
+            for (int i = 0; i < DMA_FRAMES; i++)
+                buffers[i] = dma_frames->frames[i].data;
+            decoder_ring = decode_ring_create_into(DMA_FRAMES, cw, ch, cache_codec, cache_decode_threads, buffers, frame_cache, cache_length);
+            if (!decoder_ring)
+            {
+                fprintf(stderr, "Failed to start decoder thread\n");
+                cleanup();
+                exit(1);
+            }
+            if (cache_low_power)
+            {
+                debprintf("Low power playback needs frames uploaded at their decoded size, ignoring it\n");
+            }
+        }
+        else if (!gpu_frames && !compressed)
+        {
+            decoder_ring = decode_ring_create(CACHE_PREFETCH_FRAMES, cw, ch, cache_codec, cache_delta, format, cache_decode_threads,
+                                              frame_cache, cache_length);
+            if (!decoder_ring)
+            {
+                fprintf(stderr, "Failed to start decoder thread\n");
+                cleanup();
+                exit(1);
+            }
+            if (cache_low_power && decode_ring_set_low_power(decoder_ring, FRAME_TIME) != 0)
+            {
+                debprintf("Low power playback needs whole RGBA frames from a codec that can decode them scaled, ignoring it\n");
+            }
+        }
 
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, cache_tex);
-            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
+        debprintf("Entering cache render loop (passthrough shader)\n");
 
-            free(rgba); // free immediately
+        int tex_scale = 1; // Scale cache_tex is allocated at in low power mode
+        EGLSyncKHR dma_fences[DMA_FRAMES];
+        int dma_next = 0;  // Slot of the next frame from the ring
+        int dma_taken = 0; // Frames taken from the ring and not released yet
+        frame_clock_start(&clk, fps);
+        for (;;)
+        {
+            int dma_slot = -1;
+            int due_frame = (int)(clk.frame % cache_length); // Frames playback fell behind on are skipped
+            if (gpu_frames)
+            {
+                // The loop is already in video memory, playback only switches textures
+                glBindTexture(GL_TEXTURE_2D, gpu_frames[due_frame]);
+            }
+            else if (dmabuf)
+            {
+                // A frame goes back to the decoder once the GPU is done sampling it
+                while (dma_taken >= DMA_FRAMES_HELD)
+                    release_dma_frame(dma_fences, dma_next, &dma_taken);
+
+                const struct decoded_frame *frame;
+                for (;;)
+                {
+                    frame = decode_ring_next(decoder_ring);
+                    dma_slot = dma_next;
+                    dma_next = (dma_next + 1) % DMA_FRAMES;
+                    dma_taken++;
+                    dma_fences[dma_slot] = EGL_NO_SYNC_KHR; // Nothing samples it yet
+                    if (frame->frame_idx == due_frame)
+                        break;
+
+                    // Slots only go back in order, so the frames the GPU may still sample go back first
+                    decode_ring_seek(decoder_ring, due_frame);
+                    while (dma_taken > 0)
+                        release_dma_frame(dma_fences, dma_next, &dma_taken);
+                }
+                if (frame->pixels)
+                {
+                    glBindTexture(GL_TEXTURE_EXTERNAL_OES, dma_textures[dma_slot]);
+                }
+            }
+            else if (compressed)
+            {
+                // Nothing to decode, the GPU samples the blocks straight from the texture
+                const struct cached_frame *frame = &frame_cache[due_frame];
+                glBindTexture(GL_TEXTURE_2D, cache_tex);
+                glCompressedTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, cw, ch, cache_codec->gl_format, (GLsizei)frame->size, frame->data);
+            }
+            else
+            {
+                // Upload current cached frame. Delta strips only patch what changed since the frame
+                // before, so when skipping those are all uploaded and only the last one drawn
+                for (;;)
+                {
+                    const struct decoded_frame *frame = decode_ring_next(decoder_ring);
+                    bool due = frame->frame_idx == due_frame;
+                    if (!due && !cache_delta)
+                    {
+                        decode_ring_seek(decoder_ring, due_frame);
+                        decode_ring_release(decoder_ring);
+                        continue;
+                    }
+
+                    unsigned char *pixels = frame->pixels;
+
+                    if (pixels && format == FRAME_YUV420)
+                    {
+                        // Only the rows that are visible, but whole padded rows since GLES2 has no row length
+                        glActiveTexture(GL_TEXTURE0);
+                        glBindTexture(GL_TEXTURE_2D, cache_tex);
+                        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, yuv.y_stride, ch, GL_LUMINANCE, GL_UNSIGNED_BYTE, pixels);
+                        glActiveTexture(GL_TEXTURE1);
+                        glBindTexture(GL_TEXTURE_2D, cache_chroma_tex[0]);
+                        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, yuv.c_stride, (ch + 1) / 2, GL_LUMINANCE, GL_UNSIGNED_BYTE, pixels + yuv.y_size);
+                        glActiveTexture(GL_TEXTURE2);
+                        glBindTexture(GL_TEXTURE_2D, cache_chroma_tex[1]);
+                        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, yuv.c_stride, (ch + 1) / 2, GL_LUMINANCE, GL_UNSIGNED_BYTE, pixels + yuv.y_size + yuv.c_size);
+                    }
+                    else if (pixels)
+                    {
+                        glActiveTexture(GL_TEXTURE0);
+                        glBindTexture(GL_TEXTURE_2D, cache_tex);
+                        if (frame->tile_count < 0)
+                        {
+                            int fw = frame_scaled_size(cw, frame->scale);
+                            int fh = frame_scaled_size(ch, frame->scale);
+                            if (frame->scale != tex_scale)
+                            {
+                                // The decoder changed resolution, the texture follows and gets stretched over the surface
+                                GLint scaled_filter = frame->scale > 1 ? GL_LINEAR : filter;
+                                glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, fw, fh, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+                                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, scaled_filter);
+                                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, scaled_filter);
+                                tex_scale = frame->scale;
+                            }
+                            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, fw, fh, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+                        }
+                        else
+                        {
+                            upload_delta_tiles(frame, cw, ch); // Everything else is still on the texture
+                        }
+                    }
+
+                    decode_ring_release(decoder_ring); // The texture holds its own copy now
+                    if (due)
+                        break;
+                }
+            }
 
             glClear(GL_COLOR_BUFFER_BIT);
             glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+            if (dma_slot >= 0)
+            {
+                dma_fences[dma_slot] = egl_create_sync(egl_display, EGL_SYNC_FENCE_KHR, NULL);
+                if (dma_fences[dma_slot] == EGL_NO_SYNC_KHR)
+                    glFinish(); // Nothing to wait on later
+            }
 
             GLenum err = glGetError();
             if (err != GL_NO_ERROR)
@@ -1225,14 +2869,12 @@ int main(int argc, const char **argv)
                 exit(1);
             }
 
+            request_frame();
             eglSwapBuffers(egl_display, egl_surface);
-            wl_display_flush(display);
-            frame_idx = (frame_idx + 1) % cache_length;
-            struct timespec ts = {0, (long)(FRAME_TIME * 1e9)};
-            nanosleep(&ts, NULL);
+            if (wait_for_frame(&clk) < 0)
+                break;
         }
     }
-    wl_display_disconnect(display);
     cleanup();
     return 0;
 }
@@ -0,0 +1,87 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "message_queue.h"
+
+struct message_queue
+{
+    int fd; // Semaphore eventfd, one count per queued message
+    unsigned mask;
+    atomic_uint head; // Next slot the producer writes
+    atomic_uint tail; // Next slot the consumer reads
+    struct message slots[];
+};
+
+struct message_queue *message_queue_create(int capacity)
+{
+    unsigned size = 1;
+    while (size < (unsigned)capacity)
+        size <<= 1;
+
+    struct message_queue *queue = calloc(1, sizeof(struct message_queue) + size * sizeof(struct message));
+    if (!queue)
+        return NULL;
+    queue->fd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue->fd < 0)
+    {
+        perror("eventfd");
+        free(queue);
+        return NULL;
+    }
+    queue->mask = size - 1;
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    return queue;
+}
+
+void message_queue_destroy(struct message_queue *queue)
+{
+    if (!queue)
+        return;
+    close(queue->fd);
+    free(queue);
+}
+
+int message_queue_fd(const struct message_queue *queue)
+{
+    return queue->fd;
+}
+
+int message_queue_push(struct message_queue *queue, const struct message *msg)
+{
+    unsigned head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    if (head - tail > queue->mask)
+        return -1;
+
+    queue->slots[head & queue->mask] = *msg;
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+
+    // Counted only once the slot is visible, so the consumer never wakes to an empty slot
+    uint64_t one = 1;
+    if (write(queue->fd, &one, sizeof(one)) != sizeof(one))
+    {
+        // Without its count the consumer never reads the slot, so it can be taken back
+        atomic_store_explicit(&queue->head, head, memory_order_relaxed);
+        return -2;
+    }
+    return 0;
+}
+
+int message_queue_pop(struct message_queue *queue, struct message *msg)
+{
+    uint64_t count;
+    if (read(queue->fd, &count, sizeof(count)) != sizeof(count))
+        return 0;
+
+    unsigned tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&queue->head, memory_order_acquire); // Pairs with the release in push
+    if (tail == head)
+        return 0;
+    *msg = queue->slots[tail & queue->mask];
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return 1;
+}
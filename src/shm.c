@@ -0,0 +1,90 @@
+#define _GNU_SOURCE // memfd_create
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <wayland-client.h>
+#include "shm.h"
+
+void debprintf(const char *format, ...);
+
+static void buffer_release(void *data, struct wl_buffer *buffer)
+{
+    (void)buffer;
+    struct shm_frame *frame = data;
+    frame->busy = 0;
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+    .release = buffer_release,
+};
+
+struct shm_frames *shm_frames_create(struct wl_shm *shm, int w, int h, int count, uint32_t format)
+{
+    size_t frame_size = (size_t)w * h * 4;
+    size_t size = frame_size * count;
+    // wl_shm pools are sized with an int32
+    if (w <= 0 || h <= 0 || count <= 0 || size > INT32_MAX)
+        return NULL;
+
+    struct shm_frames *frames = calloc(1, sizeof(struct shm_frames) + count * sizeof(struct shm_frame));
+    if (!frames)
+        return NULL;
+    frames->count = count;
+    frames->w = w;
+    frames->h = h;
+    frames->size = size;
+
+    int fd = memfd_create("vecpaper-frames", MFD_CLOEXEC);
+    if (fd < 0)
+    {
+        perror("memfd_create");
+        free(frames);
+        return NULL;
+    }
+    if (ftruncate(fd, (off_t)size) != 0)
+    {
+        perror("ftruncate");
+        close(fd);
+        free(frames);
+        return NULL;
+    }
+    frames->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (frames->map == MAP_FAILED)
+    {
+        perror("mmap");
+        close(fd);
+        free(frames);
+        return NULL;
+    }
+
+    // The compositor keeps its own reference to the pool memory, the fd isn't needed past here
+    struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, (int32_t)size);
+    for (int i = 0; i < count; i++)
+    {
+        struct shm_frame *frame = &frames->frames[i];
+        frame->data = (unsigned char *)frames->map + i * frame_size;
+        frame->buffer = wl_shm_pool_create_buffer(pool, (int32_t)(i * frame_size), w, h, w * 4, format);
+        wl_buffer_add_listener(frame->buffer, &buffer_listener, frame);
+    }
+    wl_shm_pool_destroy(pool);
+    close(fd);
+
+    debprintf("Created %d shared memory frames of %dx%d (%.1f MiB)\n", count, w, h, size / (1024.0 * 1024.0));
+    return frames;
+}
+
+void shm_frames_destroy(struct shm_frames *frames)
+{
+    if (!frames)
+        return;
+
+    for (int i = 0; i < frames->count; i++)
+    {
+        if (frames->frames[i].buffer)
+            wl_buffer_destroy(frames->frames[i].buffer);
+    }
+    munmap(frames->map, frames->size);
+    free(frames);
+}